@@ -19,18 +19,76 @@
  * along with ScreenUi.  If not, see <http://www.gnu.org/licenses/>. 
  */
 
-#include <ScreenUi.h>
+// The system headers come first, since the C++ versions of them #undef the
+// min and max macros ScreenUi.h defines.
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 #ifdef SCREENUI_DEBUG
 #include <WProgram.h>
 #endif
 
+#include <ScreenUi.h>
+
 void* operator new(size_t size) { return malloc(size); }
 void operator delete(void* ptr) { free(ptr); }
+void* operator new(size_t size, Arena &arena) throw() { return arena.allocate(size); }
+
+// Components allocate their own memory with these, from the Arena the owner
+// was created in or else from the heap, so that it goes when the owner does.
+// They return NULL when the memory runs out, which an Arena does much sooner
+// than the heap, so every caller checks. reallocate() leaves ptr untouched
+// when it fails.
+static void *allocate(const void *owner, size_t size) {
+  Arena *arena = Arena::find(owner);
+  return arena ? arena->allocate(size) : malloc(size);
+}
+
+static void *reallocate(const void *owner, void *ptr, size_t oldSize, size_t newSize) {
+  Arena *arena = Arena::find(owner);
+  return arena ? arena->reallocate(ptr, oldSize, newSize) : realloc(ptr, newSize);
+}
+
+static void release(void *ptr) {
+  Arena *arena = Arena::find(ptr);
+  if (arena) {
+    arena->release(ptr);
+  }
+  else {
+    free(ptr);
+  }
+}
+
+// Limits on the size of each Component, since there can be many of them and
+// very little RAM. Each limit is the size of the class's parent plus the
+// pointers and other bytes of the fields the class adds, so the same limits
+// hold on AVR and on a host. Anything that makes these fail to compile should
+// be a deliberate choice, with the limit raised to match.
+#define SCREENUI_ALIGN(n) (((n) + __alignof__(void *) - 1) / __alignof__(void *) * __alignof__(void *))
+#define SCREENUI_SIZE_LIMIT(parent, pointers, bytes) \
+    SCREENUI_ALIGN(SCREENUI_ALIGN(sizeof(parent)) + (pointers) * sizeof(void *) + (bytes))
+SCREENUI_STATIC_ASSERT(sizeof(Component) <= SCREENUI_ALIGN(sizeof(void *)
+    + 2 * sizeof(screen_coord_t) + 2 * sizeof(screen_size_t) + 1), componentSize);
+SCREENUI_STATIC_ASSERT(sizeof(Container) <= SCREENUI_SIZE_LIMIT(Component, 1, 2 * sizeof(screen_count_t)), containerSize);
+SCREENUI_STATIC_ASSERT(sizeof(Label) <= SCREENUI_SIZE_LIMIT(Component, 1, 1), labelSize);
+SCREENUI_STATIC_ASSERT(sizeof(MarqueeLabel) <= SCREENUI_SIZE_LIMIT(Label, 0, 6), marqueeLabelSize);
+SCREENUI_STATIC_ASSERT(sizeof(Button) <= SCREENUI_SIZE_LIMIT(Label, 0, 0), buttonSize);
+SCREENUI_STATIC_ASSERT(sizeof(Checkbox) <= SCREENUI_SIZE_LIMIT(Label, 0, 0), checkboxSize);
+SCREENUI_STATIC_ASSERT(sizeof(List) <= SCREENUI_SIZE_LIMIT(Label, 1, 2), listSize);
+SCREENUI_STATIC_ASSERT(sizeof(Spinner) <= SCREENUI_SIZE_LIMIT(Label, 0, 10 + 4 * sizeof(int)), spinnerSize);
+SCREENUI_STATIC_ASSERT(sizeof(Input) <= SCREENUI_SIZE_LIMIT(Label, 1, 1), inputSize);
+SCREENUI_STATIC_ASSERT(sizeof(DigitInput) <= SCREENUI_SIZE_LIMIT(Input, 0, DIGIT_INPUT_MAX_DIGITS + 3 + 3 * sizeof(long)), digitInputSize);
+SCREENUI_STATIC_ASSERT(sizeof(LevelGraph) <= SCREENUI_SIZE_LIMIT(Component, 2, 2 * sizeof(int)), levelGraphSize);
+SCREENUI_STATIC_ASSERT(sizeof(LogView) <= SCREENUI_SIZE_LIMIT(Component, 1, 8), logViewSize);
+SCREENUI_STATIC_ASSERT(sizeof(Menu) <= SCREENUI_SIZE_LIMIT(Component, 1, 10 + 4 * MENU_MAX_DEPTH), menuSize);
 
 // TODO: Change to PROGMEM
 uint8_t charCheckmark[] =     {0,     // B00000
@@ -46,6 +104,8 @@ uint8_t charCheckmark[] =     {0,     // B00000
 ////////////////////////////////////////////////////////////////////////////////
 // Screen
 ////////////////////////////////////////////////////////////////////////////////
+Screen *Screen::updating_ = NULL;
+
 Screen::Screen(uint8_t width, uint8_t height) {
   setSize(width, height);
   cleared_ = false;
@@ -53,6 +113,41 @@ Screen::Screen(uint8_t width, uint8_t height) {
   focusHolderSelected_ = false;
   createCustomChar(7, charCheckmark);
   annoyingBugWorkedAround_ = false;
+  levelGlyphsLoaded_ = false;
+  spatialFocus_ = false;
+  focusIndex_ = NULL;
+  focusIndexCount_ = 0;
+  focusIndexVersion_ = layoutVersion_ - 1;
+  focusIndexPosition_ = 0;
+  time_ = 0;
+  deadlineRequested_ = false;
+  eventHead_ = eventCount_ = 0;
+  eventHandler_ = NULL;
+}
+
+Screen::~Screen() {
+  release(focusIndex_);
+}
+
+bool Screen::loadLevelGlyphs() {
+  if (levelGlyphsLoaded_) {
+    return true;
+  }
+  if (!Utf8::reserveCustomChars(0x7f)) {
+    return false;
+  }
+  // Slot n holds a block filled n + 1 rows from the bottom. Empty and full
+  // cells are drawn with a space and the ROM's full block, so only the seven
+  // partial levels need custom characters.
+  uint8_t glyph[8];
+  for (uint8_t slot = 0; slot < 7; slot++) {
+    for (uint8_t row = 0; row < 8; row++) {
+      glyph[row] = (row >= 7 - slot) ? 31 : 0;
+    }
+    createCustomChar(slot, glyph);
+  }
+  levelGlyphsLoaded_ = true;
+  return true;
 }
 
 void Screen::update() {
@@ -60,6 +155,8 @@ void Screen::update() {
     clear();
     cleared_ = true;
   }
+  deadlineRequested_ = false;
+  updating_ = this;
   Container::update(this);
   int x, y;
   bool selected, cancelled;
@@ -73,8 +170,10 @@ void Screen::update() {
       if (selected) {
         focusHolderSelected_ = focusHolder_->handleInputEvent(x, y, selected, cancelled);
       }
+      else if (spatialFocus_) {
+        focusHolder_ = spatialFocusHolder(x, y);
+      }
       else if (x || y) {
-        // TODO: Make axis x or y configurable.
         // TODO: consider making the last widget in the screen the end of focus,
         // so that you don't cycle back to the top but instead lock at the end
         // and vice-verse. Maybe make this configurable.
@@ -101,9 +200,16 @@ void Screen::update() {
       oldFocusHolder->repaint();
     }
     focusHolder_->repaint();
+    postEvent(focusHolder_, EVENT_FOCUS_CHANGED);
   }
   paint(this);
   moveCursor(cursorX_, cursorY_);
+  endUpdate();
+  updating_ = NULL;
+  ScreenEvent event;
+  while (eventHandler_ && nextEvent(&event)) {
+    eventHandler_(this, &event);
+  }
   
   // TODO: Bug I can't figure out. If we use the dirtyness system, the first paint
   // fails to draw anything to the screen and then subsequent ones don't get called
@@ -117,310 +223,1883 @@ void Screen::update() {
   }
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// Container
-////////////////////////////////////////////////////////////////////////////////
-Container::Container() {
-  components_ = NULL;
-  componentsLength_ = 0;
-  componentCount_ = 0;
-}
-
-Container::~Container() {
-  if (components_) {
-    free(components_);
+void Screen::postEvent(Component *component, uint8_t type) {
+  if (eventCount_ == SCREEN_MAX_EVENTS) {
+    // Drop the oldest event to make room.
+    eventHead_ = (eventHead_ + 1) % SCREEN_MAX_EVENTS;
+    eventCount_--;
   }
+  ScreenEvent *event = &events_[(eventHead_ + eventCount_) % SCREEN_MAX_EVENTS];
+  event->component = component;
+  event->type = type;
+  eventCount_++;
 }
 
-void Container::update(Screen *screen) {
-  if (!firstUpdateCompleted_) {
-    offsetChildren(0, y_);
-    firstUpdateCompleted_ = true;
-  }
-  for (int i = 0; i < componentCount_; i++) {
-    components_[i]->update(screen);
+bool Screen::nextEvent(ScreenEvent *event) {
+  if (!eventCount_) {
+    return false;
   }
+  *event = events_[eventHead_];
+  eventHead_ = (eventHead_ + 1) % SCREEN_MAX_EVENTS;
+  eventCount_--;
+  return true;
 }
 
-void Container::paint(Screen *screen) {
-  for (int i = 0; i < componentCount_; i++) {
-    if (components_[i]->dirty()) {
-      components_[i]->paint(screen);
-    }
+void Screen::requestUpdate(uint32_t time) {
+  if (!deadlineRequested_ || (int32_t) (time - deadline_) < 0) {
+    deadline_ = time;
+    deadlineRequested_ = true;
   }
 }
 
-void Container::repaint() {
-  for (int i = 0; i < componentCount_; i++) {
-    components_[i]->repaint();
+uint32_t Screen::idleTime() {
+  if (!deadlineRequested_) {
+    return 0xffffffff;
   }
+  int32_t idle = deadline_ - time_;
+  return idle > 0 ? idle : 0;
 }
 
-void Container::add(Component *component, int8_t x, int8_t y) {
-  if (!components_ || componentsLength_ <= componentCount_) {
-    componentsLength_ = (componentsLength_ * 2) + 1;
-    components_ = (Component**) realloc(components_, componentsLength_ * sizeof(Component*));
+bool Screen::focusBefore(const FocusEntry &a, const FocusEntry &b) {
+  int aTop = a.block ? a.block->y() : a.component->y();
+  int bTop = b.block ? b.block->y() : b.component->y();
+  if (aTop != bTop) {
+    return aTop < bTop;
   }
-  components_[componentCount_++] = component;
-  if (firstUpdateCompleted_) {
-    // TODO: if the first update has already completed we need to update
-    // incoming components locations as they are added
+  if (a.block != b.block) {
+    if (!a.block || !b.block) {
+      return !a.block;
+    }
+    return a.block->x() < b.block->x();
   }
-  component->setLocation(x, y);
-  component->repaint();
-}
-
-void Container::offsetChildren(int x, int y) {
-  for (int i = 0; i < componentCount_; i++) {
-    Component *c = components_[i];
-    /*
-    Serial.print("Moving ");
-    Serial.print(c->description());
-    Serial.print(" from ");
-    Serial.print(c->x(), DEC);
-    Serial.print(", ");
-    Serial.print(c->y(), DEC);
-    Serial.print(" to ");
-    Serial.print(c->x() + x, DEC);
-    Serial.print(", ");
-    Serial.println(c->y() + y, DEC);
-    */
-    c->setLocation(c->x() + x, c->y() + y);
+  if (a.component->y() != b.component->y()) {
+    return a.component->y() < b.component->y();
   }
+  return a.component->x() < b.component->x();
 }
 
-Component *Container::nextFocusHolder(Component *focusHolder, bool reverse) {
-  bool focusHolderFound = false;
-  return nextFocusHolder(focusHolder, reverse, &focusHolderFound);
+bool Screen::sameRow(const FocusEntry &a, const FocusEntry &b) {
+  return a.block == b.block && a.component->y() == b.component->y();
 }
 
-Component *Container::nextFocusHolder(Component *focusHolder, bool reverse, bool *focusHolderFound) {
-  for (int i = (reverse ? componentCount_ - 1 : 0); (reverse ? (i > 0) : (i < componentCount_)); (reverse ? i-- : i++)) {
-    Component *c = components_[i];
-    if (c->isContainer()) {
-      Component *next = ((Container*) c)->nextFocusHolder(focusHolder, reverse, focusHolderFound);
-      if (next) {
-        return next;
-      }
+Component *Screen::spatialFocusHolder(int x, int y) {
+  if (focusIndexVersion_ != layoutVersion_) {
+    screen_count_t count = collectFocusHolders(NULL, NULL);
+    FocusEntry *focusIndex = (FocusEntry *) reallocate(this, focusIndex_, focusIndexCount_ * sizeof(FocusEntry), count * sizeof(FocusEntry));
+    if (!focusIndex && count) {
+      // Without an index focus stays where it is.
+      return focusHolder_;
     }
-    else {
-      if (c->acceptsFocus()) {
-        if (!focusHolder || *focusHolderFound) {
-          return c;
-        }
-        else if (c == focusHolder) {
-          *focusHolderFound = true;
-        }
+    focusIndex_ = focusIndex;
+    focusIndexCount_ = collectFocusHolders(focusIndex_, NULL);
+    // Insertion sort, since the index is small and rebuilt rarely.
+    for (screen_count_t i = 1; i < focusIndexCount_; i++) {
+      FocusEntry entry = focusIndex_[i];
+      int j = i - 1;
+      while (j >= 0 && focusBefore(entry, focusIndex_[j])) {
+        focusIndex_[j + 1] = focusIndex_[j];
+        j--;
       }
+      focusIndex_[j + 1] = entry;
     }
+    focusIndexVersion_ = layoutVersion_;
+    focusIndexPosition_ = 0;
   }
-  return NULL;
-}
 
-bool Container::dirty() {
-  for (int i = 0; i < componentCount_; i++) {
-    if (components_[i]->dirty()) {
-      return true;
+  int index = -1;
+  if (focusIndexPosition_ < focusIndexCount_
+      && focusIndex_[focusIndexPosition_].component == focusHolder_) {
+    index = focusIndexPosition_;
+  }
+  else {
+    for (screen_count_t i = 0; i < focusIndexCount_; i++) {
+      if (focusIndex_[i].component == focusHolder_) {
+        index = i;
+        break;
+      }
     }
   }
-  return false;
-}
+  if (index < 0) {
+    focusIndexPosition_ = 0;
+    return focusIndexCount_ ? focusIndex_[0].component : focusHolder_;
+  }
 
-bool Container::contains(Component *component) {
-  for (int i = 0; i < componentCount_; i++) {
-    Component *c = components_[i];
-    if (c == component) {
-      return true;
+  // Left and right move along the index, which continues on to the next row
+  // at the end of a row.
+  index = max(min(index + x, focusIndexCount_ - 1), 0);
+
+  // Up and down move one row at a time to the Component in that row with the
+  // closest x.
+  for (; y; y += (y > 0 ? -1 : 1)) {
+    FocusEntry row = focusIndex_[index];
+    screen_coord_t column = row.component->x();
+    int step = y > 0 ? 1 : -1;
+    int i = index;
+    while (i >= 0 && i < focusIndexCount_ && sameRow(focusIndex_[i], row)) {
+      i += step;
     }
-    else if (c->isContainer()) {
-      if (((Container*) c)->contains(component)) {
-        return true;
+    if (i < 0 || i >= focusIndexCount_) {
+      break;
+    }
+    FocusEntry nextRow = focusIndex_[i];
+    index = i;
+    for (; i >= 0 && i < focusIndexCount_ && sameRow(focusIndex_[i], nextRow); i += step) {
+      int distance = focusIndex_[i].component->x() - column;
+      int best = focusIndex_[index].component->x() - column;
+      if ((distance < 0 ? -distance : distance) < (best < 0 ? -best : best)) {
+        index = i;
       }
     }
   }
-  return false;
+  focusIndexPosition_ = index;
+  return focusIndex_[index].component;
+}
+
+#ifdef SCREENUI_DEFAULT_HARDWARE
+// Weak, so that any of these the main program defines are used instead.
+__attribute__((weak)) void Screen::getInputDeltas(int *x, int *y, bool *selected, bool *cancelled) {
+  *x = *y = 0;
+  *selected = *cancelled = false;
 }
+__attribute__((weak)) void Screen::clear() {}
+__attribute__((weak)) void Screen::createCustomChar(uint8_t slot, uint8_t *data) {}
+__attribute__((weak)) void Screen::draw(uint8_t x, uint8_t y, const char *text) {}
+__attribute__((weak)) void Screen::draw(uint8_t x, uint8_t y, uint8_t customChar) {}
+__attribute__((weak)) void Screen::setCursorVisible(bool visible) {}
+__attribute__((weak)) void Screen::setBlink(bool blink) {}
+__attribute__((weak)) void Screen::moveCursor(uint8_t x, uint8_t y) {}
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////
-// Component
+// TerminalScreen
 ////////////////////////////////////////////////////////////////////////////////
 
-void Component::paint(Screen *screen) {
-  dirty_ = false;
+static uint8_t digits(uint8_t n) {
+  return n > 99 ? 3 : n > 9 ? 2 : 1;
 }
 
-bool Component::dirty() {
-  return dirty_;
+// Returns the number of bytes in a cursor movement sequence with the
+// parameter n. A parameter of 1 is the default and can be left out.
+static uint8_t sequenceLength(uint8_t n) {
+  return 3 + (n > 1 ? digits(n) : 0);
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// Label
-////////////////////////////////////////////////////////////////////////////////
-Label::Label(const char *text) {
-  setSize(0, 1);
-  setText(text);
-  captured_ = false;
-  dirtyWidth_ = 0;
+TerminalScreen::TerminalScreen(uint8_t width, uint8_t height) : Screen(width, height) {
+  memset(customChars_, '#', sizeof(customChars_));
+  substitutedSlots_ = 0;
+  // Checkbox's check mark.
+  setCustomCharSubstitute(7, 'v');
+  bufferLength_ = 0;
+  terminalX_ = terminalY_ = 0xff;
+  cursorVisible_ = blink_ = false;
+  terminalCursorShown_ = terminalCursorStyle_ = 0xff;
 }
 
-void Label::paint(Screen *screen) {
-  Component::paint(screen);
-  
-  // Label does not accept focus, but Button, Checkbox and List are all
-  // subclasses that want to share the same text drawing system, so we
-  // just account for it here.
-  if (acceptsFocus()) {
-    if (screen->focusHolder() == this) {
-      if (captured_) {
-        screen->draw(x_, y_, ">");
-        screen->draw(x_ + width_ + 1, y_, "<");
+void TerminalScreen::flush() {
+  if (bufferLength_) {
+    write(buffer_, bufferLength_);
+    bufferLength_ = 0;
+  }
+}
+
+void TerminalScreen::put(char ch) {
+  if (bufferLength_ == sizeof(buffer_)) {
+    flush();
+  }
+  buffer_[bufferLength_++] = ch;
+}
+
+void TerminalScreen::putNumber(uint8_t n) {
+  if (n > 99) {
+    put('0' + n / 100);
+  }
+  if (n > 9) {
+    put('0' + (n / 10) % 10);
+  }
+  put('0' + n % 10);
+}
+
+void TerminalScreen::putSequence(uint8_t n, char command) {
+  put('\033');
+  put('[');
+  if (n > 1) {
+    putNumber(n);
+  }
+  put(command);
+}
+
+void TerminalScreen::moveTo(uint8_t x, uint8_t y) {
+  if (x == terminalX_ && y == terminalY_) {
+    return;
+  }
+  // The absolute position, leaving out the parameters that are 1.
+  uint8_t absoluteLength = 3 + ((x || y) ? digits(y + 1) : 0) + (x ? 1 + digits(x + 1) : 0);
+  uint8_t relativeLength = 0xff;
+  bool carriageReturn = false;
+  if (terminalX_ != 0xff) {
+    int dx = x - terminalX_;
+    int dy = y - terminalY_;
+    relativeLength = dy ? sequenceLength(dy > 0 ? dy : -dy) : 0;
+    uint8_t horizontalLength = 0;
+    if (dx > 0) {
+      horizontalLength = sequenceLength(dx);
+    }
+    else if (dx < 0) {
+      // A backspace is a single byte move left.
+      horizontalLength = min(-dx, sequenceLength(-dx));
+    }
+    uint8_t carriageReturnLength = 1 + (x ? sequenceLength(x) : 0);
+    if (dx && carriageReturnLength < horizontalLength) {
+      horizontalLength = carriageReturnLength;
+      carriageReturn = true;
+    }
+    relativeLength += horizontalLength;
+  }
+
+  if (absoluteLength <= relativeLength) {
+    put('\033');
+    put('[');
+    if (y || x) {
+      putNumber(y + 1);
+    }
+    if (x) {
+      put(';');
+      putNumber(x + 1);
+    }
+    put('H');
+  }
+  else {
+    int dx = x - terminalX_;
+    int dy = y - terminalY_;
+    if (dy) {
+      putSequence(dy > 0 ? dy : -dy, dy > 0 ? 'B' : 'A');
+    }
+    if (carriageReturn) {
+      put('\r');
+      if (x) {
+        putSequence(x, 'C');
+      }
+    }
+    else if (dx > 0) {
+      putSequence(dx, 'C');
+    }
+    else if (dx < 0) {
+      if (-dx < sequenceLength(-dx)) {
+        for (int i = 0; i < -dx; i++) {
+          put('\b');
+        }
       }
       else {
-        screen->draw(x_, y_, "<");
-        screen->draw(x_ + width_ + 1, y_, ">");
+        putSequence(-dx, 'D');
       }
     }
-    else {
-      screen->draw(x_, y_, "[");
-      screen->draw(x_ + width_ + 1, y_, "]");
-    }
   }
-  
-  screen->draw(x_ + (acceptsFocus() ? 1 : 0), y_, text_);
-  if (dirtyWidth_) {
-    for (int i = 0; i < dirtyWidth_ - width_; i++) {
-      screen->draw(x_ + width_ + i + (acceptsFocus() ? 2 : 0), y_, " ");
+  terminalX_ = x;
+  terminalY_ = y;
+}
+
+void TerminalScreen::clear() {
+  put('\033');
+  put('[');
+  put('H');
+  put('\033');
+  put('[');
+  put('2');
+  put('J');
+  terminalX_ = terminalY_ = 0;
+}
+
+void TerminalScreen::createCustomChar(uint8_t slot, uint8_t *data) {
+  if (substitutedSlots_ & (1 << (slot & 7))) {
+    return;
+  }
+  // Pick a substitute with roughly the same amount of ink as the glyph.
+  uint8_t pixels = 0;
+  for (uint8_t row = 0; row < 8; row++) {
+    for (uint8_t bit = 0; bit < 5; bit++) {
+      pixels += (data[row] >> bit) & 1;
     }
-    dirtyWidth_ = 0;
   }
+  customChars_[slot & 7] = " .,-=+*#"[(pixels * 7 + 39) / 40];
 }
 
-void Label::setText(const char *text) {
-  text_ = (char*) text;
-  uint8_t newWidth = strlen(text);
-  if (newWidth < width_) {
-    dirtyWidth_ = width_;
+void TerminalScreen::draw(uint8_t x, uint8_t y, const char *text) {
+  if (y >= height_) {
+    return;
+  }
+  // Nothing is drawn past the right edge, since terminals would wrap it on to
+  // the next line.
+  for (; *text && x < width_; text++, x++) {
+    draw(x, y, (uint8_t) *text);
   }
-  width_ = newWidth;
-  repaint();
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// Button
-////////////////////////////////////////////////////////////////////////////////
-Button::Button(const char *text) : Label(text) {
-  setText(text);
-  pressed_ = false;
+void TerminalScreen::draw(uint8_t x, uint8_t y, uint8_t customChar) {
+  if (x >= width_ || y >= height_) {
+    return;
+  }
+  moveTo(x, y);
+  if (customChar < 8) {
+    put(customChars_[customChar]);
+  }
+  else if (customChar == 0xff) {
+    // The full block used by LevelGraph.
+    put('#');
+  }
+  else if (customChar < 0x7f) {
+    put(customChar);
+  }
+  else {
+    // Labels hold the display's character codes, which the terminal expects
+    // as UTF-8.
+    uint16_t c = Utf8::codepoint(customChar);
+    if (c == 0) {
+      put('?');
+    }
+    else if (c < 0x800) {
+      put(0xc0 | (c >> 6));
+      put(0x80 | (c & 0x3f));
+    }
+    else {
+      put(0xe0 | (c >> 12));
+      put(0x80 | ((c >> 6) & 0x3f));
+      put(0x80 | (c & 0x3f));
+    }
+  }
+  // At the right edge terminals differ on where the cursor ends up.
+  terminalX_ = (x + 1 < width_) ? x + 1 : 0xff;
 }
 
-void Button::update(Screen *screen) {
-  pressed_ = false;
+void TerminalScreen::setCursorVisible(bool visible) {
+  cursorVisible_ = visible;
 }
 
-bool Button::handleInputEvent(int x, int y, bool selected, bool cancelled) {
-  pressed_ = selected;
-  return false;
+void TerminalScreen::setBlink(bool blink) {
+  blink_ = blink;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// Checkbox
-////////////////////////////////////////////////////////////////////////////////
-
-Checkbox::Checkbox() : Label(" ") {
-  checked_ = false;
+void TerminalScreen::updateCursor() {
+  uint8_t shown = cursorVisible_ || blink_;
+  if (shown != terminalCursorShown_) {
+    put('\033');
+    put('[');
+    put('?');
+    put('2');
+    put('5');
+    put(shown ? 'h' : 'l');
+    terminalCursorShown_ = shown;
+  }
+  // The LCD's blink is a flashing block and its cursor is an underline.
+  uint8_t style = blink_ ? 1 : 4;
+  if (shown && style != terminalCursorStyle_) {
+    putSequence(style, ' ');
+    put('q');
+    terminalCursorStyle_ = style;
+  }
 }
 
-bool Checkbox::handleInputEvent(int x, int y, bool selected, bool cancelled) {
-  if (selected) {
-    checked_ = !checked_;
-    // Not James Bond. The 8th custom character location. By using a non-zero
-    // location we can still send it via a string, which means we can still
-    // be a Label instead of having a custom paint routine.
-    setText(checked_ ? "\007" : " ");
-    repaint();
+void TerminalScreen::moveCursor(uint8_t x, uint8_t y) {
+  // There's no point moving a hidden cursor.
+  updateCursor();
+  if (terminalCursorShown_) {
+    moveTo(x, y);
   }
-  return false;
+}
+
+void TerminalScreen::endUpdate() {
+  flush();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// List
+// TraceRecorder
 ////////////////////////////////////////////////////////////////////////////////
 
-List::List(uint8_t maxItems) : Label(NULL) {
-  items_ = (char **) malloc(maxItems * (sizeof(char*)));
-  itemCount_ = 0;
-  selectedIndex_ = 0;
-  captured_ = false;
+// Stores n as a variable length integer and returns the number of bytes used.
+static uint8_t putTraceNumber(uint8_t *buffer, uint32_t n) {
+  uint8_t length = 0;
+  while (n > 127) {
+    buffer[length++] = (n & 127) | 128;
+    n >>= 7;
+  }
+  buffer[length++] = n;
+  return length;
 }
 
-List::~List() {
-  free(items_);
+static uint8_t putTraceSignedNumber(uint8_t *buffer, int n) {
+  return putTraceNumber(buffer, ((uint32_t) n << 1) ^ (uint32_t) (n < 0 ? -1 : 0));
 }
 
-void List::addItem(const char *item) {
-  items_[itemCount_++] = (char*) item;
-  if (text_ == NULL) {
-    setText(selectedItem());
-  }
+TraceRecorder::TraceRecorder(uint8_t width, uint8_t height) : Screen(width, height) {
+  started_ = false;
+  lastUpdate_ = 0;
+  lastTime_ = 0;
 }
 
-void List::setSelectedIndex(uint8_t selectedIndex) {
-  selectedIndex_ = selectedIndex;
-  setText(selectedItem());
-  repaint();
+void TraceRecorder::update() {
+  uint8_t buffer[16];
+  if (!started_) {
+    buffer[0] = 'S';
+    buffer[1] = 'U';
+    buffer[2] = 'T';
+    buffer[3] = SCREENUI_TRACE_VERSION;
+    buffer[4] = width_;
+    buffer[5] = height_;
+    writeTrace(buffer, 6);
+    lastUpdate_ = now();
+    started_ = true;
+  }
+  uint32_t start = now();
+  Screen::update();
+  uint32_t end = now();
+  uint8_t length = 0;
+  buffer[length++] = TRACE_FRAME;
+  length += putTraceNumber(buffer + length, start - lastUpdate_);
+  length += putTraceNumber(buffer + length, end - start);
+  length += putTraceNumber(buffer + length, time() - lastTime_);
+  writeTrace(buffer, length);
+  lastUpdate_ = start;
+  lastTime_ = time();
 }
 
-bool List::handleInputEvent(int x, int y, bool selected, bool cancelled) {
-  if (captured_ && y) {
-    if (y < 0) {
-      setSelectedIndex(max(selectedIndex_ + y, 0));
-    }
-    else {
-      setSelectedIndex(min(selectedIndex_ + y, itemCount_ - 1));
-    }
+void TraceRecorder::getInputDeltas(int *x, int *y, bool *selected, bool *cancelled) {
+  Screen::getInputDeltas(x, y, selected, cancelled);
+  if (*x || *y || *selected || *cancelled) {
+    uint8_t buffer[12];
+    uint8_t length = 0;
+    buffer[length++] = TRACE_INPUT;
+    length += putTraceSignedNumber(buffer + length, *x);
+    length += putTraceSignedNumber(buffer + length, *y);
+    buffer[length++] = (*selected ? 1 : 0) | (*cancelled ? 2 : 0);
+    writeTrace(buffer, length);
   }
-  if (selected) {
-    captured_ = !captured_;
-    repaint();
-  }
-  return captured_;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// Spinner
-////////////////////////////////////////////////////////////////////////////////
+void TraceRecorder::clear() {
+  Screen::clear();
+  uint8_t buffer[] = { TRACE_CLEAR };
+  writeTrace(buffer, sizeof(buffer));
+}
 
-Spinner::Spinner(int value, int low, int high, int increment, bool rollover) : Label(NULL) {
-  value_ = value;
-  low_ = low;
-  high_ = high;
-  increment_ = increment;
-  rollover_ = rollover;
-  sprintf(buffer_, "%d", value_);
-  setText(buffer_);
+void TraceRecorder::createCustomChar(uint8_t slot, uint8_t *data) {
+  Screen::createCustomChar(slot, data);
+  uint8_t buffer[] = { TRACE_CUSTOM_CHAR, slot };
+  writeTrace(buffer, sizeof(buffer));
+  writeTrace(data, 8);
 }
 
-int Spinner::intValue() {
-  return value_;
+void TraceRecorder::draw(uint8_t x, uint8_t y, const char *text) {
+  Screen::draw(x, y, text);
+  uint8_t length = min(strlen(text), 255);
+  uint8_t buffer[] = { TRACE_TEXT, x, y, length };
+  writeTrace(buffer, sizeof(buffer));
+  writeTrace((const uint8_t *) text, length);
 }
 
-bool Spinner::handleInputEvent(int x, int y, bool selected, bool cancelled) {
-  if (captured_ && y) {
-    value_ += (y * increment_);
-    if (value_ < low_) {
-      value_ = rollover_ ? high_ : low_;
-    }
-    else if (value_ > high_) {
-      value_ = rollover_ ? low_ : high_;
-    }
-    sprintf(buffer_, "%d", value_);
-    setText(buffer_);
+void TraceRecorder::draw(uint8_t x, uint8_t y, uint8_t customChar) {
+  Screen::draw(x, y, customChar);
+  uint8_t buffer[] = { TRACE_CHAR, x, y, customChar };
+  writeTrace(buffer, sizeof(buffer));
+}
+
+void TraceRecorder::setCursorVisible(bool visible) {
+  Screen::setCursorVisible(visible);
+  uint8_t buffer[] = { TRACE_CURSOR_VISIBLE, visible };
+  writeTrace(buffer, sizeof(buffer));
+}
+
+void TraceRecorder::setBlink(bool blink) {
+  Screen::setBlink(blink);
+  uint8_t buffer[] = { TRACE_BLINK, blink };
+  writeTrace(buffer, sizeof(buffer));
+}
+
+void TraceRecorder::moveCursor(uint8_t x, uint8_t y) {
+  Screen::moveCursor(x, y);
+  uint8_t buffer[] = { TRACE_MOVE_CURSOR, x, y };
+  writeTrace(buffer, sizeof(buffer));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// TraceReplayer
+////////////////////////////////////////////////////////////////////////////////
+
+TraceReplayer::TraceReplayer(const uint8_t *trace, uint32_t length) :
+    Screen(length >= 6 ? trace[4] : 0, length >= 6 ? trace[5] : 0) {
+  trace_ = trace;
+  length_ = length;
+  position_ = 6;
+  if (length < 6 || trace[0] != 'S' || trace[1] != 'U' || trace[2] != 'T'
+      || trace[3] != SCREENUI_TRACE_VERSION) {
+    position_ = length_ = 0;
+  }
+  initFrame(&recorded_);
+  initFrame(&replayed_);
+  frames_ = mismatchedFrames_ = firstMismatchedFrame_ = 0;
+  recordedDrawBytes_ = replayedDrawBytes_ = 0;
+  recordedUpdateTime_ = replayedUpdateTime_ = 0;
+}
+
+TraceReplayer::~TraceReplayer() {
+  free(recorded_.cells);
+  free(replayed_.cells);
+}
+
+void TraceReplayer::initFrame(Frame *frame) {
+  frame->cells = (char *) malloc(width_ * height_);
+  memset(frame->cells, ' ', width_ * height_);
+  frame->cursorX = frame->cursorY = 0;
+  frame->cursorVisible = frame->blink = false;
+}
+
+void TraceReplayer::drawFrame(Frame *frame, uint8_t x, uint8_t y, uint8_t ch) {
+  if (x < width_ && y < height_) {
+    frame->cells[y * width_ + x] = ch;
+  }
+}
+
+uint8_t TraceReplayer::readByte() {
+  return position_ < length_ ? trace_[position_++] : 0;
+}
+
+uint32_t TraceReplayer::readNumber() {
+  uint32_t n = 0;
+  for (uint8_t shift = 0; shift < 32; shift += 7) {
+    uint8_t b = readByte();
+    n |= (uint32_t) (b & 127) << shift;
+    if (!(b & 128)) {
+      break;
+    }
+  }
+  return n;
+}
+
+int TraceReplayer::readSignedNumber() {
+  uint32_t n = readNumber();
+  return (int) (n >> 1) ^ -(int) (n & 1);
+}
+
+void TraceReplayer::update() {
+  // Apply the recorded output for the next frame and pick up its input, so
+  // that the Components see the same input they saw when it was recorded.
+  inputX_ = inputY_ = 0;
+  inputSelected_ = inputCancelled_ = false;
+  bool frameFound = false;
+  while (!frameFound && !finished()) {
+    switch (readByte()) {
+      case TRACE_FRAME:
+        readNumber();
+        recordedUpdateTime_ += readNumber();
+        setTime(time() + readNumber());
+        frameFound = true;
+        break;
+      case TRACE_INPUT: {
+        inputX_ = readSignedNumber();
+        inputY_ = readSignedNumber();
+        uint8_t flags = readByte();
+        inputSelected_ = flags & 1;
+        inputCancelled_ = flags & 2;
+        break;
+      }
+      case TRACE_TEXT: {
+        uint8_t x = readByte();
+        uint8_t y = readByte();
+        uint8_t length = readByte();
+        for (uint8_t i = 0; i < length; i++) {
+          drawFrame(&recorded_, x + i, y, readByte());
+        }
+        recordedDrawBytes_ += length;
+        break;
+      }
+      case TRACE_CHAR: {
+        uint8_t x = readByte();
+        uint8_t y = readByte();
+        drawFrame(&recorded_, x, y, readByte());
+        recordedDrawBytes_++;
+        break;
+      }
+      case TRACE_MOVE_CURSOR:
+        recorded_.cursorX = readByte();
+        recorded_.cursorY = readByte();
+        break;
+      case TRACE_CURSOR_VISIBLE:
+        recorded_.cursorVisible = readByte();
+        break;
+      case TRACE_BLINK:
+        recorded_.blink = readByte();
+        break;
+      case TRACE_CLEAR:
+        memset(recorded_.cells, ' ', width_ * height_);
+        break;
+      case TRACE_CUSTOM_CHAR:
+        position_ += 9;
+        break;
+      default:
+        // A record we don't understand, so nothing after it can be trusted.
+        position_ = length_;
+        return;
+    }
+  }
+  if (!frameFound) {
+    return;
+  }
+
+  uint32_t start = now();
+  Screen::update();
+  replayedUpdateTime_ += now() - start;
+
+  frames_++;
+  if (memcmp(recorded_.cells, replayed_.cells, width_ * height_)
+      || recorded_.cursorX != replayed_.cursorX
+      || recorded_.cursorY != replayed_.cursorY
+      || recorded_.cursorVisible != replayed_.cursorVisible
+      || recorded_.blink != replayed_.blink) {
+    if (!mismatchedFrames_) {
+      firstMismatchedFrame_ = frames_;
+    }
+    mismatchedFrames_++;
+  }
+}
+
+void TraceReplayer::getInputDeltas(int *x, int *y, bool *selected, bool *cancelled) {
+  *x = inputX_;
+  *y = inputY_;
+  *selected = inputSelected_;
+  *cancelled = inputCancelled_;
+}
+
+void TraceReplayer::clear() {
+  memset(replayed_.cells, ' ', width_ * height_);
+}
+
+void TraceReplayer::createCustomChar(uint8_t slot, uint8_t *data) {
+}
+
+void TraceReplayer::draw(uint8_t x, uint8_t y, const char *text) {
+  for (; *text; text++, x++) {
+    drawFrame(&replayed_, x, y, *text);
+    replayedDrawBytes_++;
+  }
+}
+
+void TraceReplayer::draw(uint8_t x, uint8_t y, uint8_t customChar) {
+  drawFrame(&replayed_, x, y, customChar);
+  replayedDrawBytes_++;
+}
+
+void TraceReplayer::setCursorVisible(bool visible) {
+  replayed_.cursorVisible = visible;
+}
+
+void TraceReplayer::setBlink(bool blink) {
+  replayed_.blink = blink;
+}
+
+void TraceReplayer::moveCursor(uint8_t x, uint8_t y) {
+  replayed_.cursorX = x;
+  replayed_.cursorY = y;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// MirrorScreen
+////////////////////////////////////////////////////////////////////////////////
+
+MirrorScreen::MirrorScreen(uint8_t width, uint8_t height) : Screen(width, height) {
+  cells_ = (char *) allocate(this, width_ * height_);
+  if (cells_) {
+    memset(cells_, ' ', width_ * height_);
+  }
+  outputCount_ = 0;
+  cursorX_ = cursorY_ = 0;
+  cursorVisible_ = blink_ = false;
+  // Screen's constructor couldn't reach our createCustomChar().
+  glyphsCreated_ = 0;
+  createCustomChar(7, charCheckmark);
+}
+
+MirrorScreen::~MirrorScreen() {
+  release(cells_);
+  for (uint8_t i = 0; i < outputCount_; i++) {
+    release(outputs_[i].cells);
+  }
+}
+
+bool MirrorScreen::addOutput(Screen *screen, uint16_t interval, uint8_t characters) {
+  if (!cells_ || outputCount_ == MIRROR_MAX_OUTPUTS) {
+    return false;
+  }
+  char *cells = (char *) allocate(this, width_ * height_);
+  if (!cells) {
+    return false;
+  }
+  memset(cells, ' ', width_ * height_);
+  Output *output = &outputs_[outputCount_++];
+  output->screen = screen;
+  output->cells = cells;
+  output->cleared = false;
+  output->interval = interval;
+  output->characters = characters;
+  output->lastFlush = 0;
+  output->position = 0;
+  output->cursorX = output->cursorY = output->cursorVisible = output->blink = 0xff;
+  for (uint8_t slot = 0; slot < 8; slot++) {
+    if (glyphsCreated_ & (1 << slot)) {
+      screen->createCustomChar(slot, glyphs_[slot]);
+    }
+  }
+  return true;
+}
+
+void MirrorScreen::flush() {
+  for (uint8_t i = 0; i < outputCount_; i++) {
+    flushOutput(&outputs_[i], width_ * height_);
+  }
+}
+
+void MirrorScreen::flushOutput(Output *output, uint16_t characters) {
+  Screen *screen = output->screen;
+  uint16_t size = width_ * height_;
+  bool sent = false;
+  if (!output->cleared) {
+    // We don't know what the output is showing until it's been cleared.
+    screen->clear();
+    output->cleared = true;
+    sent = true;
+  }
+  // Send runs of changed cells, starting where the last flush stopped. Each
+  // run stops at the end of a row or when the characters run out.
+  uint16_t i = output->position;
+  for (uint16_t scanned = 0; scanned < size && characters; ) {
+    if (output->cells[i] == cells_[i]) {
+      scanned++;
+      i = (i + 1 < size) ? i + 1 : 0;
+      continue;
+    }
+    uint8_t x = i % width_;
+    uint8_t y = i / width_;
+    char text[17];
+    uint8_t length = 0;
+    while (x + length < width_ && length < sizeof(text) - 1 && characters
+        && output->cells[i] != cells_[i]) {
+      uint8_t ch = cells_[i];
+      if (ch < 8) {
+        // Custom characters can't be sent in text, since slot 0 would end it.
+        break;
+      }
+      text[length++] = ch;
+      output->cells[i++] = ch;
+      characters--;
+    }
+    if (length) {
+      text[length] = 0;
+      screen->draw(x, y, text);
+      scanned += length;
+    }
+    else {
+      screen->draw(x, y, (uint8_t) cells_[i]);
+      output->cells[i] = cells_[i];
+      i++;
+      scanned++;
+      characters--;
+    }
+    if (i == size) {
+      i = 0;
+    }
+    sent = true;
+  }
+  output->position = i;
+
+  if (output->cursorVisible != cursorVisible_) {
+    screen->setCursorVisible(cursorVisible_);
+    output->cursorVisible = cursorVisible_;
+    sent = true;
+  }
+  if (output->blink != blink_) {
+    screen->setBlink(blink_);
+    output->blink = blink_;
+    sent = true;
+  }
+  // Drawing moves the hardware cursor, so it has to be put back after
+  // anything is sent.
+  if (sent || output->cursorX != cursorX_ || output->cursorY != cursorY_) {
+    screen->moveCursor(cursorX_, cursorY_);
+    output->cursorX = cursorX_;
+    output->cursorY = cursorY_;
+  }
+  screen->endUpdate();
+}
+
+void MirrorScreen::clear() {
+  if (cells_) {
+    memset(cells_, ' ', width_ * height_);
+  }
+}
+
+void MirrorScreen::createCustomChar(uint8_t slot, uint8_t *data) {
+  // Glyphs are sent straight away, since they are rarely changed.
+  slot &= 7;
+  memcpy(glyphs_[slot], data, 8);
+  glyphsCreated_ |= 1 << slot;
+  for (uint8_t i = 0; i < outputCount_; i++) {
+    Output *output = &outputs_[i];
+    output->screen->createCustomChar(slot, data);
+    // Outputs that substitute custom characters need the cells using this
+    // one to be sent again, so make them differ from the frame.
+    for (uint16_t j = 0; j < width_ * height_; j++) {
+      if (output->cells[j] == slot) {
+        output->cells[j] = ~slot;
+      }
+    }
+  }
+}
+
+void MirrorScreen::draw(uint8_t x, uint8_t y, const char *text) {
+  if (!cells_ || y >= height_) {
+    return;
+  }
+  for (; *text && x < width_; text++, x++) {
+    cells_[y * width_ + x] = *text;
+  }
+}
+
+void MirrorScreen::draw(uint8_t x, uint8_t y, uint8_t customChar) {
+  if (cells_ && x < width_ && y < height_) {
+    cells_[y * width_ + x] = customChar;
+  }
+}
+
+void MirrorScreen::setCursorVisible(bool visible) {
+  cursorVisible_ = visible;
+}
+
+void MirrorScreen::setBlink(bool blink) {
+  blink_ = blink;
+}
+
+void MirrorScreen::moveCursor(uint8_t x, uint8_t y) {
+  cursorX_ = x;
+  cursorY_ = y;
+}
+
+void MirrorScreen::endUpdate() {
+  uint32_t now = time();
+  for (uint8_t i = 0; i < outputCount_; i++) {
+    Output *output = &outputs_[i];
+    if (!output->cleared || now - output->lastFlush >= output->interval) {
+      flushOutput(output, output->characters ? output->characters : width_ * height_);
+      output->lastFlush = now;
+    }
+    if (pending(output)) {
+      requestUpdate(output->lastFlush + output->interval);
+    }
+  }
+}
+
+bool MirrorScreen::pending(Output *output) {
+  return memcmp(output->cells, cells_, width_ * height_)
+      || output->cursorX != cursorX_ || output->cursorY != cursorY_
+      || output->cursorVisible != cursorVisible_ || output->blink != blink_;
+}
+
+#ifdef __linux__
+////////////////////////////////////////////////////////////////////////////////
+// SharedMemoryScreen
+////////////////////////////////////////////////////////////////////////////////
+
+SharedMemoryScreen::SharedMemoryScreen(uint8_t width, uint8_t height, const char *name) : Screen(width, height) {
+  name_ = name;
+  frame_ = NULL;
+  cells_ = NULL;
+  size_t size = sizeof(SharedFrame) + width * height;
+  int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+  if (fd < 0) {
+    return;
+  }
+  if (ftruncate(fd, size) == 0) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p != MAP_FAILED) {
+      frame_ = (SharedFrame *) p;
+    }
+  }
+  close(fd);
+  if (!frame_) {
+    return;
+  }
+  cells_ = (char *) (frame_ + 1);
+  // Readers check the magic last, so they never see a half set up frame.
+  memset(frame_, 0, size);
+  memset(cells_, ' ', width * height);
+  frame_->width = width;
+  frame_->height = height;
+  // Screen's constructor created the checkmark before this class existed,
+  // so it never reached the segment.
+  memcpy(frame_->glyphs[7], charCheckmark, sizeof(charCheckmark));
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  frame_->magic[0] = 'S';
+  frame_->magic[1] = 'U';
+  frame_->magic[2] = 'F';
+  frame_->magic[3] = SCREENUI_SHARED_VERSION;
+}
+
+SharedMemoryScreen::~SharedMemoryScreen() {
+  if (frame_) {
+    munmap(frame_, sizeof(SharedFrame) + width_ * height_);
+    shm_unlink(name_);
+  }
+}
+
+void SharedMemoryScreen::beginChange() {
+  uint32_t sequence = __atomic_load_n(&frame_->sequence, __ATOMIC_RELAXED);
+  if (!(sequence & 1)) {
+    __atomic_store_n(&frame_->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  }
+}
+
+void SharedMemoryScreen::clear() {
+  if (frame_) {
+    beginChange();
+    memset(cells_, ' ', width_ * height_);
+  }
+}
+
+void SharedMemoryScreen::createCustomChar(uint8_t slot, uint8_t *data) {
+  if (frame_) {
+    beginChange();
+    memcpy(frame_->glyphs[slot & 7], data, 8);
+  }
+}
+
+void SharedMemoryScreen::draw(uint8_t x, uint8_t y, const char *text) {
+  if (!frame_ || y >= height_) {
+    return;
+  }
+  beginChange();
+  for (; *text && x < width_; text++, x++) {
+    cells_[y * width_ + x] = *text;
+  }
+}
+
+void SharedMemoryScreen::draw(uint8_t x, uint8_t y, uint8_t customChar) {
+  if (frame_ && x < width_ && y < height_) {
+    beginChange();
+    cells_[y * width_ + x] = customChar;
+  }
+}
+
+void SharedMemoryScreen::setCursorVisible(bool visible) {
+  if (frame_ && frame_->cursorVisible != visible) {
+    beginChange();
+    frame_->cursorVisible = visible;
+  }
+}
+
+void SharedMemoryScreen::setBlink(bool blink) {
+  if (frame_ && frame_->blink != blink) {
+    beginChange();
+    frame_->blink = blink;
+  }
+}
+
+void SharedMemoryScreen::moveCursor(uint8_t x, uint8_t y) {
+  if (!frame_) {
+    return;
+  }
+  if (frame_->cursorX != x || frame_->cursorY != y) {
+    beginChange();
+    frame_->cursorX = x;
+    frame_->cursorY = y;
+  }
+}
+
+void SharedMemoryScreen::endUpdate() {
+  if (!frame_) {
+    return;
+  }
+  // Marks the frame complete.
+  uint32_t sequence = __atomic_load_n(&frame_->sequence, __ATOMIC_RELAXED);
+  if (sequence & 1) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    __atomic_store_n(&frame_->sequence, sequence + 1, __ATOMIC_RELAXED);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SharedFrameReader
+////////////////////////////////////////////////////////////////////////////////
+
+SharedFrameReader::SharedFrameReader(const char *name) {
+  frame_ = NULL;
+  size_ = 0;
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) {
+    return;
+  }
+  // Map just the header first to find out how big the frame is.
+  void *p = mmap(NULL, sizeof(SharedFrame), PROT_READ, MAP_SHARED, fd, 0);
+  if (p != MAP_FAILED) {
+    SharedFrame *header = (SharedFrame *) p;
+    if (header->magic[0] == 'S' && header->magic[1] == 'U' && header->magic[2] == 'F'
+        && header->magic[3] == SCREENUI_SHARED_VERSION) {
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      size_ = sizeof(SharedFrame) + header->width * header->height;
+    }
+    munmap(p, sizeof(SharedFrame));
+  }
+  if (size_) {
+    p = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+    if (p != MAP_FAILED) {
+      frame_ = (SharedFrame *) p;
+    }
+  }
+  close(fd);
+}
+
+SharedFrameReader::~SharedFrameReader() {
+  if (frame_) {
+    munmap(frame_, size_);
+  }
+}
+
+uint32_t SharedFrameReader::sequence() {
+  return __atomic_load_n(&frame_->sequence, __ATOMIC_ACQUIRE) & ~1;
+}
+
+bool SharedFrameReader::read(SharedFrame *frame, char *cells) {
+  // The UI updates a few times a second at most, so a handful of tries is
+  // plenty.
+  for (uint8_t tries = 0; tries < 16; tries++) {
+    uint32_t before = __atomic_load_n(&frame_->sequence, __ATOMIC_ACQUIRE);
+    if (before & 1) {
+      usleep(100);
+      continue;
+    }
+    memcpy(frame, frame_, sizeof(SharedFrame));
+    memcpy(cells, frame_ + 1, frame_->width * frame_->height);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&frame_->sequence, __ATOMIC_RELAXED) == before) {
+      return true;
+    }
+  }
+  return false;
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Container
+////////////////////////////////////////////////////////////////////////////////
+uint16_t Container::layoutVersion_ = 0;
+
+Container::Container() {
+  components_ = NULL;
+  componentsLength_ = 0;
+  componentCount_ = 0;
+  setFlag(FIRST_UPDATE_COMPLETED, false);
+}
+
+Container::~Container() {
+  if (components_) {
+    release(components_);
+  }
+}
+
+void Container::update(Screen *screen) {
+  if (!flag(FIRST_UPDATE_COMPLETED)) {
+    offsetChildren(0, y_);
+    layoutVersion_++;
+    setFlag(FIRST_UPDATE_COMPLETED, true);
+  }
+  for (int i = 0; i < componentCount_; i++) {
+    components_[i]->update(screen);
+  }
+}
+
+void Container::paint(Screen *screen) {
+  for (int i = 0; i < componentCount_; i++) {
+    if (components_[i]->dirty()) {
+      components_[i]->paint(screen);
+    }
+  }
+}
+
+void Container::repaint() {
+  for (int i = 0; i < componentCount_; i++) {
+    components_[i]->repaint();
+  }
+}
+
+void Container::add(Component *component, screen_coord_t x, screen_coord_t y) {
+  if (componentCount_ == SCREEN_COUNT_MAX) {
+    return;
+  }
+  if (!components_ || componentsLength_ <= componentCount_) {
+    screen_count_t length = min((long) componentsLength_ * 2 + 1, (long) SCREEN_COUNT_MAX);
+    Component **components = (Component**) reallocate(this, components_, componentsLength_ * sizeof(Component*), length * sizeof(Component*));
+    if (!components) {
+      return;
+    }
+    components_ = components;
+    componentsLength_ = length;
+  }
+  components_[componentCount_++] = component;
+  if (flag(FIRST_UPDATE_COMPLETED)) {
+    // TODO: if the first update has already completed we need to update
+    // incoming components locations as they are added
+  }
+  component->setLocation(x, y);
+  component->repaint();
+  layoutVersion_++;
+}
+
+void Container::offsetChildren(int x, int y) {
+  for (int i = 0; i < componentCount_; i++) {
+    Component *c = components_[i];
+    /*
+    Serial.print("Moving ");
+    Serial.print(c->description());
+    Serial.print(" from ");
+    Serial.print(c->x(), DEC);
+    Serial.print(", ");
+    Serial.print(c->y(), DEC);
+    Serial.print(" to ");
+    Serial.print(c->x() + x, DEC);
+    Serial.print(", ");
+    Serial.println(c->y() + y, DEC);
+    */
+    // The coordinates wrap past the ends of their type, so scrolling back
+    // undoes any offset exactly. A ScrollContainer with more rows than the
+    // type can count would show wrapped rows, so those need
+    // SCREENUI_WIDE_COORDINATES.
+    c->setLocation((screen_coord_t) (c->x() + x), (screen_coord_t) (c->y() + y));
+  }
+}
+
+screen_count_t Container::collectFocusHolders(FocusEntry *entries, Container *block) {
+  screen_count_t count = 0;
+  for (int i = 0; i < componentCount_; i++) {
+    Component *c = components_[i];
+    if (c->isContainer()) {
+      Container *container = (Container*) c;
+      count += container->collectFocusHolders(entries ? entries + count : NULL,
+          (block || !container->scrolls()) ? block : container);
+    }
+    else if (c->acceptsFocus()) {
+      if (entries) {
+        entries[count].component = c;
+        entries[count].block = block;
+      }
+      count++;
+    }
+  }
+  return count;
+}
+
+Component *Container::nextFocusHolder(Component *focusHolder, bool reverse) {
+  bool focusHolderFound = false;
+  return nextFocusHolder(focusHolder, reverse, &focusHolderFound);
+}
+
+Component *Container::nextFocusHolder(Component *focusHolder, bool reverse, bool *focusHolderFound) {
+  for (int i = (reverse ? componentCount_ - 1 : 0); (reverse ? (i >= 0) : (i < componentCount_)); (reverse ? i-- : i++)) {
+    Component *c = components_[i];
+    if (c->isContainer()) {
+      Component *next = ((Container*) c)->nextFocusHolder(focusHolder, reverse, focusHolderFound);
+      if (next) {
+        return next;
+      }
+    }
+    else {
+      if (c->acceptsFocus()) {
+        if (!focusHolder || *focusHolderFound) {
+          return c;
+        }
+        else if (c == focusHolder) {
+          *focusHolderFound = true;
+        }
+      }
+    }
+  }
+  return NULL;
+}
+
+bool Container::dirty() {
+  for (int i = 0; i < componentCount_; i++) {
+    if (components_[i]->dirty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Container::contains(Component *component) {
+  for (int i = 0; i < componentCount_; i++) {
+    Component *c = components_[i];
+    if (c == component) {
+      return true;
+    }
+    else if (c->isContainer()) {
+      if (((Container*) c)->contains(component)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Component
+////////////////////////////////////////////////////////////////////////////////
+
+void Component::paint(Screen *screen) {
+  setFlag(DIRTY, false);
+}
+
+bool Component::dirty() {
+  return flag(DIRTY);
+}
+
+void Component::postEvent(uint8_t type) {
+  Screen *screen = Screen::updating();
+  if (screen) {
+    screen->postEvent(this, type);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Label
+////////////////////////////////////////////////////////////////////////////////
+// The buffer a Label converts UTF-8 text in to. It keeps the caller's text
+// so that Label only needs the one pointer, and how much room there is for
+// the converted text.
+struct LabelText {
+  const char *text;
+  uint8_t capacity;
+  char display[1];
+};
+#define LABEL_TEXT_SIZE(capacity) (offsetof(LabelText, display) + (capacity))
+
+Label::Label(const char *text) {
+  setSize(0, 1);
+  text_ = NULL;
+  setFlag(TRANSCODED, false);
+  setText(text);
+  setFlag(CAPTURED, false);
+  dirtyWidth_ = 0;
+}
+
+void Label::paint(Screen *screen) {
+  Component::paint(screen);
+  
+  // Label does not accept focus, but Button, Checkbox and List are all
+  // subclasses that want to share the same text drawing system, so we
+  // just account for it here.
+  // Everything is drawn left to right so that each draw starts where the
+  // last one ended, which lets backends skip repositioning the cursor.
+  const char *left = NULL, *right = NULL;
+  if (acceptsFocus()) {
+    if (screen->focusHolder() == this) {
+      left = flag(CAPTURED) ? ">" : "<";
+      right = flag(CAPTURED) ? "<" : ">";
+    }
+    else {
+      left = "[";
+      right = "]";
+    }
+    screen->draw(x_, y_, left);
+  }
+  
+  screen->draw(x_ + (acceptsFocus() ? 1 : 0), y_, displayText());
+  if (right) {
+    screen->draw(x_ + width_ + 1, y_, right);
+  }
+  if (dirtyWidth_) {
+    for (int i = 0; i < dirtyWidth_ - width_; i++) {
+      screen->draw(x_ + width_ + i + (acceptsFocus() ? 2 : 0), y_, " ");
+    }
+    dirtyWidth_ = 0;
+  }
+}
+
+Label::~Label() {
+  if (flag(TRANSCODED)) {
+    release(text_);
+  }
+}
+
+const char *Label::text() {
+  return flag(TRANSCODED) ? ((LabelText *) text_)->text : text_;
+}
+
+const char *Label::displayText() {
+  return flag(TRANSCODED) ? ((LabelText *) text_)->display : text_;
+}
+
+void Label::setText(const char *text) {
+  LabelText *buffer = flag(TRANSCODED) ? (LabelText *) text_ : NULL;
+  // List and Spinner start out with no text.
+  uint8_t newWidth = 0;
+  bool ascii = true;
+  for (const char *p = text; p && *p; p++) {
+    ascii &= !(*p & 0x80);
+    newWidth++;
+  }
+  // Once a Label has a buffer it keeps using it, even for ASCII, so that
+  // text that changes back and forth doesn't allocate every time. The
+  // converted text is never longer than the UTF-8, so the buffer only has to
+  // grow when longer text is set.
+  if ((buffer || !ascii) && (!buffer || buffer->capacity < newWidth + 1)) {
+    LabelText *grown = (LabelText *) reallocate(this, buffer,
+        buffer ? LABEL_TEXT_SIZE(buffer->capacity) : 0, LABEL_TEXT_SIZE(newWidth + 1));
+    // If there is no memory for the converted text the UTF-8 is drawn as it
+    // is.
+    if (!grown) {
+      release(buffer);
+    }
+    else {
+      grown->capacity = newWidth + 1;
+    }
+    buffer = grown;
+  }
+  if (buffer) {
+    buffer->text = text;
+    newWidth = Utf8::transcode(text ? text : "", buffer->display);
+    text_ = (char *) buffer;
+  }
+  else {
+    text_ = (char *) text;
+  }
+  setFlag(TRANSCODED, buffer);
+  if (newWidth < width_) {
+    dirtyWidth_ = width_;
+  }
+  width_ = newWidth;
+  repaint();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// MarqueeLabel
+////////////////////////////////////////////////////////////////////////////////
+// The number of spaces between the end of scrolling text and its start.
+#define MARQUEE_GAP 3
+
+MarqueeLabel::MarqueeLabel(const char *text, uint8_t maxWidth, uint16_t interval) : Label(text) {
+  setMaxWidth(maxWidth, interval);
+  // Nothing has been drawn yet, so there is nothing to clear.
+  dirtyWidth_ = 0;
+}
+
+void MarqueeLabel::setMaxWidth(uint8_t maxWidth, uint16_t interval) {
+  maxWidth_ = maxWidth;
+  interval_ = interval;
+  setText(Label::text());
+}
+
+void MarqueeLabel::setText(const char *text) {
+  screen_size_t oldWidth = width_;
+  Label::setText(text);
+  if (maxWidth_ && width_ > maxWidth_) {
+    width_ = maxWidth_;
+    // Label only clears what its own width uncovered.
+    if (oldWidth > width_ && oldWidth > dirtyWidth_) {
+      dirtyWidth_ = oldWidth;
+    }
+  }
+  offset_ = 0;
+  setFlag(RESTART, true);
+}
+
+char MarqueeLabel::marqueeChar(const char *text, uint8_t length, uint16_t i) {
+  i %= length + MARQUEE_GAP;
+  return i < length ? text[i] : ' ';
+}
+
+void MarqueeLabel::update(Screen *screen) {
+  const char *text = displayText();
+  uint8_t length = text ? strlen(text) : 0;
+  if (length <= width_) {
+    return;
+  }
+  uint16_t time = screen->time();
+  if (flag(RESTART)) {
+    nextShift_ = time + interval_;
+    setFlag(RESTART, false);
+  }
+  else if ((int16_t) (time - nextShift_) >= 0) {
+    offset_ = (offset_ + 1) % (length + MARQUEE_GAP);
+    nextShift_ = time + interval_;
+    // Only the characters that change need drawing, unless the whole Label
+    // is already going to be painted.
+    if (!flag(DIRTY)) {
+      setFlag(SHIFTED, true);
+    }
+    setFlag(DIRTY, true);
+  }
+  screen->requestUpdate(screen->time() + (int16_t) (nextShift_ - time));
+}
+
+void MarqueeLabel::repaint() {
+  setFlag(SHIFTED, false);
+  Label::repaint();
+}
+
+void MarqueeLabel::paint(Screen *screen) {
+  const char *text = displayText();
+  uint8_t length = text ? strlen(text) : 0;
+  if (length <= width_) {
+    Label::paint(screen);
+    return;
+  }
+  Component::paint(screen);
+
+  if (flag(SHIFTED)) {
+    for (uint8_t i = 0; i < width_; i++) {
+      char ch = marqueeChar(text, length, offset_ + i);
+      if (ch != marqueeChar(text, length, offset_ + length + MARQUEE_GAP - 1 + i)) {
+        screen->draw(x_ + i, y_, (uint8_t) ch);
+      }
+    }
+    setFlag(SHIFTED, false);
+    return;
+  }
+  // The text is clipped, so it has to be drawn a character at a time.
+  for (uint8_t i = 0; i < width_; i++) {
+    screen->draw(x_ + i, y_, (uint8_t) marqueeChar(text, length, offset_ + i));
+  }
+  for (uint8_t i = width_; i < dirtyWidth_; i++) {
+    screen->draw(x_ + i, y_, " ");
+  }
+  dirtyWidth_ = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Button
+////////////////////////////////////////////////////////////////////////////////
+Button::Button(const char *text) : Label(text) {
+  setText(text);
+  setFlag(PRESSED, false);
+}
+
+void Button::update(Screen *screen) {
+  setFlag(PRESSED, false);
+}
+
+bool Button::handleInputEvent(int x, int y, bool selected, bool cancelled) {
+  setFlag(PRESSED, selected);
+  if (selected) {
+    postEvent(EVENT_PRESSED);
+  }
+  return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Checkbox
+////////////////////////////////////////////////////////////////////////////////
+
+Checkbox::Checkbox() : Label(" ") {
+  setFlag(CHECKED, false);
+}
+
+void Checkbox::setChecked(bool checked) {
+  setFlag(CHECKED, checked);
+  // Not James Bond. The 8th custom character location. By using a non-zero
+  // location we can still send it via a string, which means we can still
+  // be a Label instead of having a custom paint routine.
+  setText(flag(CHECKED) ? "\007" : " ");
+  repaint();
+}
+
+bool Checkbox::handleInputEvent(int x, int y, bool selected, bool cancelled) {
+  if (selected) {
+    setChecked(!flag(CHECKED));
+    postEvent(EVENT_TOGGLED);
+  }
+  return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// List
+////////////////////////////////////////////////////////////////////////////////
+
+List::List(uint8_t maxItems) : Label(NULL) {
+  items_ = (char **) allocate(this, maxItems * (sizeof(char*)));
+  itemCount_ = 0;
+  selectedIndex_ = 0;
+  setFlag(CAPTURED, false);
+}
+
+List::~List() {
+  release(items_);
+}
+
+void List::addItem(const char *item) {
+  if (!items_) {
+    return;
+  }
+  items_[itemCount_++] = (char*) item;
+  if (Label::text() == NULL) {
+    setText(selectedItem());
+  }
+}
+
+void List::setSelectedIndex(uint8_t selectedIndex) {
+  selectedIndex_ = selectedIndex;
+  setText(selectedItem());
+  repaint();
+}
+
+void List::restoreState(const uint8_t *data) {
+  // The List may have fewer items than when it was saved.
+  if (data[0] < itemCount_) {
+    setSelectedIndex(data[0]);
+  }
+}
+
+bool List::handleInputEvent(int x, int y, bool selected, bool cancelled) {
+  if (flag(CAPTURED) && y) {
+    uint8_t oldIndex = selectedIndex_;
+    if (y < 0) {
+      setSelectedIndex(max(selectedIndex_ + y, 0));
+    }
+    else {
+      setSelectedIndex(min(selectedIndex_ + y, itemCount_ - 1));
+    }
+    if (selectedIndex_ != oldIndex) {
+      postEvent(EVENT_VALUE_CHANGED);
+    }
+  }
+  if (selected) {
+    setFlag(CAPTURED, !flag(CAPTURED));
+    repaint();
+  }
+  return flag(CAPTURED);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Spinner
+////////////////////////////////////////////////////////////////////////////////
+
+Spinner::Spinner(int value, int low, int high, int increment, bool rollover) : Label(NULL) {
+  value_ = value;
+  low_ = low;
+  high_ = high;
+  increment_ = increment;
+  setFlag(ROLLOVER, rollover);
+  sprintf(buffer_, "%d", value_);
+  setText(buffer_);
+}
+
+int Spinner::intValue() {
+  return value_;
+}
+
+void Spinner::setValue(int value) {
+  value_ = max(min(value, high_), low_);
+  sprintf(buffer_, "%d", value_);
+  setText(buffer_);
+}
+
+void Spinner::saveState(uint8_t *data) {
+  data[0] = value_ & 0xff;
+  data[1] = (value_ >> 8) & 0xff;
+}
+
+void Spinner::restoreState(const uint8_t *data) {
+  setValue((int16_t) (data[0] | (data[1] << 8)));
+}
+
+bool Spinner::handleInputEvent(int x, int y, bool selected, bool cancelled) {
+  if (flag(CAPTURED) && y) {
+    int oldValue = value_;
+    value_ += (y * increment_);
+    if (value_ < low_) {
+      value_ = flag(ROLLOVER) ? high_ : low_;
+    }
+    else if (value_ > high_) {
+      value_ = flag(ROLLOVER) ? low_ : high_;
+    }
+    sprintf(buffer_, "%d", value_);
+    setText(buffer_);
+    repaint();
+    if (value_ != oldValue) {
+      postEvent(EVENT_VALUE_CHANGED);
+    }
+  }
+  if (selected) {
+    setFlag(CAPTURED, !flag(CAPTURED));
     repaint();
   }
-  if (selected) {
-    captured_ = !captured_;
-    repaint();
+  return flag(CAPTURED);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// LevelGraph
+////////////////////////////////////////////////////////////////////////////////
+
+LevelGraph::LevelGraph(uint8_t width, uint8_t height, int low, int high) {
+  setSize(width, height);
+  low_ = low;
+  high_ = high;
+  levels_ = (uint8_t *) allocate(this, width * 2);
+  if (levels_) {
+    paintedLevels_ = levels_ + width;
+    memset(levels_, 0, width * 2);
+  }
+  else {
+    // Out of memory, so show nothing.
+    setSize(0, height);
+  }
+  setFlag(FULL_REPAINT, true);
+}
+
+LevelGraph::~LevelGraph() {
+  release(levels_);
+}
+
+uint8_t LevelGraph::levelOf(int value) {
+  if (value <= low_) {
+    return 0;
+  }
+  if (value >= high_) {
+    return height_ * 8;
+  }
+  return (uint8_t) (((long) (value - low_) * (height_ * 8)) / (high_ - low_));
+}
+
+void LevelGraph::setLevel(uint8_t column, uint8_t level) {
+  if (column < width_ && levels_[column] != level) {
+    levels_[column] = level;
+    // Not repaint(), which would throw away what we know about the
+    // characters already on screen.
+    setFlag(DIRTY, true);
+  }
+}
+
+void LevelGraph::repaint() {
+  setFlag(FULL_REPAINT, true);
+  Component::repaint();
+}
+
+void LevelGraph::paint(Screen *screen) {
+  Component::paint(screen);
+  bool partial = screen->loadLevelGlyphs();
+  for (uint8_t column = 0; column < width_; column++) {
+    uint8_t level = levels_[column];
+    uint8_t paintedLevel = paintedLevels_[column];
+    if (level == paintedLevel && !flag(FULL_REPAINT)) {
+      continue;
+    }
+    // Row 0 is the bottom of the graph. Each row holds up to 8 levels of the
+    // column, so only the rows between the old and new level need to change.
+    for (uint8_t row = 0; row < height_; row++) {
+      uint8_t base = row * 8;
+      uint8_t fill = level <= base ? 0 : min(level - base, 8);
+      uint8_t paintedFill = paintedLevel <= base ? 0 : min(paintedLevel - base, 8);
+      if (!partial) {
+        // Round to an empty or full block.
+        fill = fill < 4 ? 0 : 8;
+        paintedFill = paintedFill < 4 ? 0 : 8;
+      }
+      if (fill == paintedFill && !flag(FULL_REPAINT)) {
+        continue;
+      }
+      uint8_t y = y_ + height_ - 1 - row;
+      if (fill == 0) {
+        screen->draw(x_ + column, y, " ");
+      }
+      else if (fill == 8) {
+        // The full block in the HD44780 character ROM.
+        screen->draw(x_ + column, y, (uint8_t) 0xff);
+      }
+      else {
+        screen->draw(x_ + column, y, (uint8_t) (fill - 1));
+      }
+    }
+    paintedLevels_[column] = level;
+  }
+  setFlag(FULL_REPAINT, false);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// BarGraph
+////////////////////////////////////////////////////////////////////////////////
+
+BarGraph::BarGraph(uint8_t bars, uint8_t height, int low, int high) : LevelGraph(bars, height, low, high) {
+}
+
+void BarGraph::setValue(uint8_t bar, int value) {
+  setLevel(bar, levelOf(value));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Sparkline
+////////////////////////////////////////////////////////////////////////////////
+
+Sparkline::Sparkline(uint8_t width, uint8_t height, int low, int high) : LevelGraph(width, height, low, high) {
+}
+
+void Sparkline::push(int value) {
+  // Shift the history left. setLevel() only marks us dirty when a column
+  // actually changes, and paint() only redraws the characters that differ,
+  // so a flat line costs nothing to scroll.
+  for (uint8_t column = 1; column < width_; column++) {
+    setLevel(column - 1, levels_[column]);
+  }
+  setLevel(width_ - 1, levelOf(value));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// LogView
+////////////////////////////////////////////////////////////////////////////////
+
+LogView::LogView(uint8_t width, uint8_t height, uint8_t capacity, bool scrollable) {
+  setSize(width, height);
+  capacity_ = capacity;
+  setFlag(SCROLLABLE, scrollable);
+  // Each line is stored padded to the full width and terminated so that it
+  // can be handed to Screen::draw() directly.
+  lines_ = (char *) allocate(this, capacity * (width + 1));
+  if (!lines_) {
+    // Out of memory, so nothing is kept.
+    capacity_ = 0;
+  }
+  setFlag(CAPTURED, false);
+  clear();
+}
+
+LogView::~LogView() {
+  release(lines_);
+}
+
+char *LogView::line(uint8_t back) {
+  return lines_ + ((head_ + capacity_ - 1 - back) % capacity_) * (width_ + 1);
+}
+
+void LogView::clear() {
+  count_ = 0;
+  head_ = 0;
+  scroll_ = 0;
+  paintedScroll_ = 0;
+  paintedCount_ = 0;
+  appendedSincePaint_ = 0;
+  paintedIndicator_ = 0;
+  repaint();
+}
+
+void LogView::append(const char *text) {
+  if (!capacity_) {
+    return;
+  }
+  char *l = lines_ + head_ * (width_ + 1);
+  uint8_t i = 0;
+  for (; i < textWidth() && text[i]; i++) {
+    l[i] = text[i];
+  }
+  for (; i < textWidth(); i++) {
+    l[i] = ' ';
+  }
+  l[i] = 0;
+  head_ = (head_ + 1) % capacity_;
+  if (count_ < capacity_) {
+    count_++;
+  }
+  if (appendedSincePaint_ < capacity_) {
+    appendedSincePaint_++;
+  }
+  // If the user has scrolled back, keep the same lines on screen rather than
+  // dragging the view along with the end of the log.
+  if (scroll_) {
+    scroll_ = min(scroll_ + 1, max(count_ - height_, 0));
+  }
+  setFlag(DIRTY, true);
+}
+
+void LogView::repaint() {
+  setFlag(FULL_REPAINT, true);
+  Component::repaint();
+}
+
+bool LogView::handleInputEvent(int x, int y, bool selected, bool cancelled) {
+  if (flag(CAPTURED) && y) {
+    // Scrolling down moves towards the end of the log.
+    int scroll = scroll_ - y;
+    scroll_ = max(min(scroll, count_ - height_), 0);
+    setFlag(DIRTY, true);
+  }
+  if (selected || cancelled) {
+    setFlag(CAPTURED, selected && !flag(CAPTURED));
+    if (!flag(CAPTURED)) {
+      scroll_ = 0;
+    }
+    setFlag(DIRTY, true);
+  }
+  return flag(CAPTURED);
+}
+
+void LogView::paint(Screen *screen) {
+  Component::paint(screen);
+  uint8_t width = textWidth();
+  for (uint8_t row = 0; row < height_; row++) {
+    int back = scroll_ + (height_ - 1 - row);
+    char *text = back < count_ ? line(back) : NULL;
+
+    // Work out what this row showed after the last paint. If it was a line
+    // that has since been pushed out of the buffer we no longer know, and
+    // the whole row is redrawn.
+    int paintedBack = paintedScroll_ + (height_ - 1 - row);
+    bool known = !flag(FULL_REPAINT);
+    char *paintedText = NULL;
+    if (known && paintedBack < paintedCount_) {
+      paintedBack += appendedSincePaint_;
+      if (paintedBack < count_) {
+        paintedText = line(paintedBack);
+      }
+      else {
+        known = false;
+      }
+    }
+
+    // Draw each run of characters that differ. The run is terminated in place
+    // so it can be drawn without copying it.
+    uint8_t start = 0;
+    while (start < width) {
+      char ch = text ? text[start] : ' ';
+      if (known && ch == (paintedText ? paintedText[start] : ' ')) {
+        start++;
+        continue;
+      }
+      if (!text) {
+        screen->draw(x_ + start, y_ + row, " ");
+        start++;
+        continue;
+      }
+      uint8_t end = start + 1;
+      while (end < width && (!known || text[end] != (paintedText ? paintedText[end] : ' '))) {
+        end++;
+      }
+      char saved = text[end];
+      text[end] = 0;
+      screen->draw(x_ + start, y_ + row, text + start);
+      text[end] = saved;
+      start = end;
+    }
+  }
+
+  if (flag(SCROLLABLE)) {
+    // The same indicators Label uses for the right side of a focusable
+    // Component.
+    char indicator[2] = { ']', 0 };
+    if (screen->focusHolder() == this) {
+      indicator[0] = flag(CAPTURED) ? '<' : '>';
+    }
+    if (flag(FULL_REPAINT) || indicator[0] != paintedIndicator_) {
+      screen->draw(x_ + width, y_ + height_ - 1, indicator);
+      paintedIndicator_ = indicator[0];
+    }
   }
+
+  paintedScroll_ = scroll_;
+  paintedCount_ = count_;
+  appendedSincePaint_ = 0;
+  setFlag(FULL_REPAINT, false);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -430,37 +2109,61 @@ bool Spinner::handleInputEvent(int x, int y, bool selected, bool cancelled) {
 // TODO: trim incoming text and after each return, right justify the text
 Input::Input(char *text) : Label((const char*) text) {
   position_ = 0;
-  selecting_ = false;
+  setFlag(SELECTING, false);
   charSet_ = &defaultCharSet;
 }
 
 void Input::setText(char *text) {
   Label::setText((const char *) text);
   position_ = 0;
-  selecting_ = false;
+  setFlag(SELECTING, false);
+  repaint();
+}
+
+void Input::saveState(uint8_t *data) {
+  memcpy(data, Label::text(), width_);
+}
+
+void Input::restoreState(const uint8_t *data) {
+  memcpy((char *) Label::text(), data, width_);
+  textChanged();
+}
+
+void Input::textChanged() {
+  // The converted copy has to be made again.
+  if (flag(TRANSCODED)) {
+    Label::setText(Label::text());
+  }
   repaint();
 }
 
 void Input::paint(Screen *screen) {
   Label::paint(screen);
-  screen->setCursorVisible(captured_ && selecting_);
-  screen->setBlink(captured_ && !selecting_);
+  screen->setCursorVisible(flag(CAPTURED) && flag(SELECTING));
+  screen->setBlink(flag(CAPTURED) && !flag(SELECTING));
   screen->setCursorLocation(x_ + position_ + 1, y_);
 }
 
 bool Input::handleInputEvent(int x, int y, bool selected, bool cancelled) {
   // If the input is captured and there has been a scroll event we're going to
   // either change the position or change the selection.
-  if (captured_ && y) {
+  if (flag(CAPTURED) && y) {
     // If we're changing the selection, scroll through the character set.
-    if (selecting_) {
+    if (flag(SELECTING)) {
       // TODO: replace this with a selectable character set that makes more
       // sense
+      // The caller's text is edited in place.
+      char *text = (char *) Label::text();
+      char oldChar = text[position_];
       if (y < 0) {
-        text_[position_] = charSet_->charAt(max(charSet_->indexOf(text_[position_]) + y, 0));
+        text[position_] = charSet_->charAt(max(charSet_->indexOf(text[position_]) + y, 0));
       }
       else {
-        text_[position_] = charSet_->charAt(min(charSet_->indexOf(text_[position_]) + y, charSet_->size() - 1));
+        text[position_] = charSet_->charAt(min(charSet_->indexOf(text[position_]) + y, charSet_->size() - 1));
+      }
+      if (text[position_] != oldChar) {
+        textChanged();
+        postEvent(EVENT_VALUE_CHANGED);
       }
     }
     // Otherwise we are changing the position. If the position is moving before
@@ -468,7 +2171,7 @@ bool Input::handleInputEvent(int x, int y, bool selected, bool cancelled) {
     else {
       position_ += y;
       if (position_ < 0 || position_ >= width_) {
-        captured_ = false;
+        setFlag(CAPTURED, false);
       }
     }
     repaint();
@@ -478,20 +2181,216 @@ bool Input::handleInputEvent(int x, int y, bool selected, bool cancelled) {
   if (selected) {
     // If input is captured we will start or end selection
     // input.
-    if (captured_) {
-      selecting_ = !selecting_;
+    if (flag(CAPTURED)) {
+      setFlag(SELECTING, !flag(SELECTING));
     }
     // Capture the input
     else {
-      captured_ = true;
+      setFlag(CAPTURED, true);
+      position_ = 0;
+      setFlag(SELECTING, false);
+    }
+    repaint();
+  }
+  return flag(CAPTURED);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// DigitInput
+////////////////////////////////////////////////////////////////////////////////
+
+DigitInput::DigitInput(long value, long low, long high) : Input(NULL) {
+  value_ = value;
+  low_ = low;
+  high_ = high;
+  buffer_[0] = 0;
+}
+
+void DigitInput::formatDigits(char *text, unsigned long value, uint8_t width) {
+  for (int i = width - 1; i >= 0; i--) {
+    text[i] = '0' + value % 10;
+    value /= 10;
+  }
+}
+
+void DigitInput::setValue(long value) {
+  value_ = max(min(value, high_), low_);
+  format();
+  Label::setText(buffer_);
+}
+
+void DigitInput::adjust(uint8_t position, int delta) {
+  setValue(value_ + delta * placeValue(position));
+}
+
+void DigitInput::saveState(uint8_t *data) {
+  for (uint8_t i = 0; i < 4; i++) {
+    data[i] = (value_ >> (i * 8)) & 0xff;
+  }
+}
+
+void DigitInput::restoreState(const uint8_t *data) {
+  uint32_t value = 0;
+  for (uint8_t i = 0; i < 4; i++) {
+    value |= (uint32_t) data[i] << (i * 8);
+  }
+  // The state is 32 bits, so it has to be sign extended where long is wider.
+  setValue((int32_t) value);
+}
+
+bool DigitInput::handleInputEvent(int x, int y, bool selected, bool cancelled) {
+  // The same as Input, except that the position skips over separators and
+  // selecting changes the value instead of scrolling through a CharSet.
+  if (flag(CAPTURED) && y) {
+    if (flag(SELECTING)) {
+      long oldValue = value_;
+      adjust(position_, y);
+      if (value_ != oldValue) {
+        postEvent(EVENT_VALUE_CHANGED);
+      }
+    }
+    else {
+      int step = y > 0 ? 1 : -1;
+      for (int i = 0; i != y && flag(CAPTURED); i += step) {
+        do {
+          position_ += step;
+        } while (position_ >= 0 && position_ < width_ && !editable(position_));
+        if (position_ < 0 || position_ >= width_) {
+          setFlag(CAPTURED, false);
+        }
+      }
+    }
+    repaint();
+  }
+  if (selected) {
+    if (flag(CAPTURED)) {
+      setFlag(SELECTING, !flag(SELECTING));
+    }
+    else {
+      setFlag(CAPTURED, true);
       position_ = 0;
-      selecting_ = false;
+      while (position_ < width_ - 1 && !editable(position_)) {
+        position_++;
+      }
+      setFlag(SELECTING, false);
     }
     repaint();
   }
-  return captured_;
+  return flag(CAPTURED);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// DecimalInput
+////////////////////////////////////////////////////////////////////////////////
+
+DecimalInput::DecimalInput(long value, uint8_t decimals, long low, long high) : DigitInput(value, low, high) {
+  signed_ = low < 0;
+  // The scale, 10 to the power of decimals, has to fit in an unsigned long.
+  // Then the digits before the point can't take the total past
+  // DIGIT_INPUT_MAX_DIGITS, which is what buffer_ has room for.
+  decimals_ = min(decimals, DIGIT_INPUT_MAX_DIGITS - 1);
+  // Enough digits before the decimal point for both limits.
+  unsigned long largest = max(low < 0 ? -low : low, high < 0 ? -high : high);
+  for (uint8_t i = 0; i < decimals_; i++) {
+    largest /= 10;
+  }
+  digits_ = 1;
+  while (largest > 9) {
+    largest /= 10;
+    digits_++;
+  }
+  setValue(value);
+}
+
+void DecimalInput::format() {
+  char *text = buffer_;
+  if (signed_) {
+    *text++ = value_ < 0 ? '-' : '+';
+  }
+  unsigned long magnitude = value_ < 0 ? -value_ : value_;
+  unsigned long scale = 1;
+  for (uint8_t i = 0; i < decimals_; i++) {
+    scale *= 10;
+  }
+  formatDigits(text, magnitude / scale, digits_);
+  text += digits_;
+  if (decimals_) {
+    *text++ = '.';
+    formatDigits(text, magnitude % scale, decimals_);
+    text += decimals_;
+  }
+  *text = 0;
+}
+
+long DecimalInput::placeValue(uint8_t position) {
+  if ((signed_ && position == 0) || buffer_[position] == '.') {
+    return 0;
+  }
+  long place = 1;
+  for (uint8_t i = width_ - 1; i > position; i--) {
+    if (buffer_[i] != '.') {
+      place *= 10;
+    }
+  }
+  return place;
+}
+
+bool DecimalInput::editable(uint8_t position) {
+  return (signed_ && position == 0) || DigitInput::editable(position);
+}
+
+void DecimalInput::adjust(uint8_t position, int delta) {
+  if (signed_ && position == 0) {
+    setValue(-value_);
+  }
+  // Digits show the magnitude, so scrolling a digit up makes a negative
+  // number more negative.
+  else if (value_ < 0) {
+    setValue(value_ - delta * placeValue(position));
+  }
+  else {
+    DigitInput::adjust(position, delta);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// TimeInput
+////////////////////////////////////////////////////////////////////////////////
+
+TimeInput::TimeInput(long seconds, uint8_t fields) : DigitInput(seconds, 0, 0) {
+  fields_ = max(min(fields, 3), 1);
+  // The first field goes up to 99 and the others are full.
+  high_ = 100 * fieldUnit(fields_ - 1) - 1;
+  setValue(seconds);
+}
+
+long TimeInput::fieldUnit(uint8_t field) {
+  return field == 2 ? 3600 : field == 1 ? 60 : 1;
+}
+
+void TimeInput::format() {
+  char *text = buffer_;
+  for (int field = fields_ - 1; field >= 0; field--) {
+    long value = value_ / fieldUnit(field);
+    if (field != fields_ - 1) {
+      value %= 60;
+      *text++ = ':';
+    }
+    formatDigits(text, value, 2);
+    text += 2;
+  }
+  *text = 0;
 }
 
+long TimeInput::placeValue(uint8_t position) {
+  if (buffer_[position] == ':') {
+    return 0;
+  }
+  // Each field is two digits and a colon, counting from the right.
+  uint8_t fromRight = width_ - 1 - position;
+  return fieldUnit(fromRight / 3) * ((fromRight % 3) ? 10 : 1);
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 // IntegerInput
@@ -519,14 +2418,16 @@ IntegerInput::IntegerInput(unsigned long value, unsigned char width, unsigned ch
 ScrollContainer::ScrollContainer(Screen *screen, uint8_t width, uint8_t height) {
   setSize(width, height);
   screen_ = screen;
-  clearLine = (char*) malloc(width + 1);
-  memset(clearLine, ' ', width);
-  clearLine[width] = NULL;
-  firstUpdateCompleted_ = false;
+  clearLine = (char*) allocate(this, width + 1);
+  if (clearLine) {
+    memset(clearLine, ' ', width);
+    clearLine[width] = 0;
+  }
+  setFlag(FIRST_UPDATE_COMPLETED, false);
 }
 
 ScrollContainer::~ScrollContainer() {
-  free(clearLine);
+  release(clearLine);
 }
 
 bool ScrollContainer::dirty() {
@@ -545,8 +2446,8 @@ bool ScrollContainer::scrollNeeded() {
       // it is, so we need to be sure it's visible, which means it's
       // y position plus height has to be within our window of visibility
       // our window of visbility is our y_ + row_ to y_ + row_ + height_
-      uint8_t yStart = y_;
-      uint8_t yEnd = y_ + height_ - 1;
+      int yStart = y_;
+      int yEnd = y_ + height_ - 1;
       if (focusHolder->y() < yStart || focusHolder->y() > yEnd) {
         // it is not currently visible, so we are dirty
         return true;
@@ -562,7 +2463,7 @@ void ScrollContainer::paint(Screen *screen) {
     // we need to scroll the window
     Component *focusHolder = screen_->focusHolder();
     // clear the window
-    for (int i = 0; i < height_; i++) {
+    for (int i = 0; clearLine && i < height_; i++) {
       screen->draw(x_, y_ + i, clearLine);
     }
     // set the new row_. if the new focus holder is below our currently
@@ -570,8 +2471,8 @@ void ScrollContainer::paint(Screen *screen) {
     // visible, and likewise if it is above, we want to decrement.
     // TODO: These are calculated in scrollNeeded(), see if it would be better
     // to reuse them somehow
-    uint8_t yStart = y_;
-    uint8_t yEnd = y_ + height_ - 1;
+    int yStart = y_;
+    int yEnd = y_ + height_ - 1;
     if (focusHolder->y() > yEnd) {
       // if the component is below our visible window, increment the row count
       // by the difference between the bottom visible row and the y position
@@ -599,6 +2500,477 @@ void ScrollContainer::paint(Screen *screen) {
   }
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Menu
+////////////////////////////////////////////////////////////////////////////////
+
+Menu::Menu(const MenuEntry *entries, uint8_t width, uint8_t height) {
+  setSize(width, height);
+  entries_ = entries;
+  depth_ = 0;
+  action_ = 0;
+  setFlag(CAPTURED, false);
+  paintedMarker_ = ' ';
+  open(0, 0, 0);
+}
+
+void Menu::open(uint16_t level, uint8_t selected, uint8_t top) {
+  level_ = level;
+  levelLength_ = 0;
+  while (screenui_read_ptr(&entries_[level + levelLength_].label)) {
+    levelLength_++;
+  }
+  selected_ = selected;
+  top_ = top;
+  repaint();
+}
+
+void Menu::update(Screen *screen) {
+  action_ = 0;
+}
+
+bool Menu::handleInputEvent(int x, int y, bool selected, bool cancelled) {
+  if (!flag(CAPTURED)) {
+    if (selected) {
+      setFlag(CAPTURED, true);
+      setFlag(DIRTY, true);
+    }
+    return flag(CAPTURED);
+  }
+  if (y && levelLength_) {
+    selected_ = max(min(selected_ + y, levelLength_ - 1), 0);
+    if (selected_ < top_) {
+      top_ = selected_;
+    }
+    else if (selected_ >= top_ + height_) {
+      top_ = selected_ - height_ + 1;
+    }
+    setFlag(DIRTY, true);
+  }
+  if (selected && levelLength_) {
+    const MenuEntry *entry = &entries_[level_ + selected_];
+    uint16_t child = screenui_read_word(&entry->child);
+    if (child) {
+      if (depth_ < MENU_MAX_DEPTH) {
+        parents_[depth_].level = level_;
+        parents_[depth_].selected = selected_;
+        parents_[depth_].top = top_;
+        depth_++;
+        open(child, 0, 0);
+      }
+    }
+    else {
+      action_ = screenui_read_byte(&entry->action);
+      postEvent(EVENT_PRESSED);
+    }
+  }
+  if (cancelled) {
+    if (depth_) {
+      depth_--;
+      open(parents_[depth_].level, parents_[depth_].selected, parents_[depth_].top);
+    }
+    else {
+      setFlag(CAPTURED, false);
+      setFlag(DIRTY, true);
+    }
+  }
+  return flag(CAPTURED);
+}
+
+char Menu::marker(Screen *screen) {
+  if (screen->focusHolder() != this) {
+    return ' ';
+  }
+  return flag(CAPTURED) ? '>' : '-';
+}
+
+void Menu::paintRow(Screen *screen, uint8_t row) {
+  uint8_t index = top_ + row;
+  const char *label = NULL;
+  if (index < levelLength_) {
+    label = (const char *) screenui_read_ptr(&entries_[level_ + index].label);
+  }
+  // Labels are read out of flash a few characters at a time and padded to
+  // the width of the Menu, so the whole row is replaced.
+  char chunk[9];
+  uint8_t length = 0;
+  chunk[length++] = (index == selected_) ? marker(screen) : ' ';
+  for (uint8_t column = 1; column <= width_; column++) {
+    if (column == width_ || length == sizeof(chunk) - 1) {
+      chunk[length] = 0;
+      screen->draw(x_ + column - length, y_ + row, chunk);
+      length = 0;
+    }
+    if (column == width_) {
+      break;
+    }
+    char ch = label ? screenui_read_byte(label) : 0;
+    if (ch) {
+      label++;
+    }
+    else {
+      label = NULL;
+      ch = ' ';
+    }
+    chunk[length++] = ch;
+  }
+}
+
+void Menu::repaint() {
+  setFlag(FULL_REPAINT, true);
+  Component::repaint();
+}
+
+void Menu::paint(Screen *screen) {
+  Component::paint(screen);
+  char m = marker(screen);
+  if (flag(FULL_REPAINT) || top_ != paintedTop_) {
+    for (uint8_t row = 0; row < height_; row++) {
+      paintRow(screen, row);
+    }
+  }
+  else if (selected_ != paintedSelected_ || m != paintedMarker_) {
+    // Only the selection moved, so only the markers need to change.
+    char text[2] = { ' ', 0 };
+    screen->draw(x_, y_ + paintedSelected_ - top_, text);
+    text[0] = m;
+    screen->draw(x_, y_ + selected_ - top_, text);
+  }
+  paintedSelected_ = selected_;
+  paintedTop_ = top_;
+  paintedMarker_ = m;
+  setFlag(FULL_REPAINT, false);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// StateSnapshot
+////////////////////////////////////////////////////////////////////////////////
+
+// The first bytes of a snapshot, followed by the StateSnapshot format version,
+// the user's version and the number of Components.
+#define STATE_SNAPSHOT_MAGIC 'W'
+#define STATE_SNAPSHOT_VERSION 1
+
+StateSnapshot::StateSnapshot(StateStorage *storage, uint16_t address, uint8_t version) {
+  storage_ = storage;
+  address_ = address;
+  version_ = version;
+  components_ = NULL;
+  ids_ = NULL;
+  componentCount_ = 0;
+}
+
+StateSnapshot::~StateSnapshot() {
+  release(components_);
+  release(ids_);
+}
+
+bool StateSnapshot::add(uint8_t id, Component *component) {
+  if (componentCount_ == 255) {
+    return false;
+  }
+  // Each array is only replaced once it has grown, so a failure leaves the
+  // snapshot as it was.
+  Component **components = (Component **) reallocate(this, components_,
+      componentCount_ * sizeof(Component*), (componentCount_ + 1) * sizeof(Component*));
+  if (!components) {
+    return false;
+  }
+  components_ = components;
+  uint8_t *ids = (uint8_t *) reallocate(this, ids_, componentCount_, componentCount_ + 1);
+  if (!ids) {
+    return false;
+  }
+  ids_ = ids;
+  components_[componentCount_] = component;
+  ids_[componentCount_] = id;
+  componentCount_++;
+  return true;
+}
+
+uint8_t StateSnapshot::maxStateSize() {
+  uint8_t size = 0;
+  for (uint8_t i = 0; i < componentCount_; i++) {
+    size = max(size, components_[i]->stateSize());
+  }
+  return size;
+}
+
+bool StateSnapshot::update(uint16_t address, uint8_t value) {
+  if (storage_->read(address) == value) {
+    return false;
+  }
+  storage_->write(address, value);
+  return true;
+}
+
+bool StateSnapshot::restore() {
+  uint16_t address = address_;
+  if (storage_->read(address++) != STATE_SNAPSHOT_MAGIC
+      || storage_->read(address++) != STATE_SNAPSHOT_VERSION
+      || storage_->read(address++) != version_) {
+    return false;
+  }
+  uint8_t count = storage_->read(address++);
+  // One more byte than the largest value, since malloc(0) may return NULL.
+  uint8_t *data = (uint8_t *) allocate(this, maxStateSize() + 1);
+  if (!data) {
+    return false;
+  }
+  for (uint8_t i = 0; i < count; i++) {
+    uint8_t id = storage_->read(address++);
+    uint8_t size = storage_->read(address++);
+    // Only restore the value if it still fits the Component with that id.
+    for (uint8_t j = 0; j < componentCount_; j++) {
+      if (ids_[j] == id && components_[j]->stateSize() == size) {
+        for (uint8_t k = 0; k < size; k++) {
+          data[k] = storage_->read(address + k);
+        }
+        components_[j]->restoreState(data);
+        break;
+      }
+    }
+    address += size;
+  }
+  release(data);
+  return true;
+}
+
+uint16_t StateSnapshot::save() {
+  // One more byte than the largest value, since malloc(0) may return NULL.
+  uint8_t *data = (uint8_t *) allocate(this, maxStateSize() + 1);
+  if (!data) {
+    return 0;
+  }
+  uint16_t address = address_;
+  uint16_t written = 0;
+  written += update(address++, STATE_SNAPSHOT_MAGIC);
+  written += update(address++, STATE_SNAPSHOT_VERSION);
+  written += update(address++, version_);
+  written += update(address++, componentCount_);
+  for (uint8_t i = 0; i < componentCount_; i++) {
+    uint8_t size = components_[i]->stateSize();
+    components_[i]->saveState(data);
+    written += update(address++, ids_[i]);
+    written += update(address++, size);
+    for (uint8_t k = 0; k < size; k++) {
+      written += update(address++, data[k]);
+    }
+  }
+  release(data);
+  if (written) {
+    storage_->commit();
+  }
+  return written;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Arena
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef __BIGGEST_ALIGNMENT__
+#define ARENA_ALIGNMENT __BIGGEST_ALIGNMENT__
+#else
+#define ARENA_ALIGNMENT sizeof(void*)
+#endif
+
+Arena *Arena::arenas_ = NULL;
+
+Arena::Arena(void *memory, size_t size) {
+  memory_ = (uint8_t *) memory;
+  size_ = size;
+  owned_ = false;
+  used_ = last_ = highWaterMark_ = 0;
+  next_ = arenas_;
+  arenas_ = this;
+}
+
+Arena::Arena(size_t size) {
+  memory_ = (uint8_t *) malloc(size);
+  size_ = memory_ ? size : 0;
+  owned_ = true;
+  used_ = last_ = highWaterMark_ = 0;
+  next_ = arenas_;
+  arenas_ = this;
+}
+
+Arena::~Arena() {
+  for (Arena **arena = &arenas_; *arena; arena = &(*arena)->next_) {
+    if (*arena == this) {
+      *arena = next_;
+      break;
+    }
+  }
+  if (owned_) {
+    free(memory_);
+  }
+}
+
+Arena *Arena::find(const void *ptr) {
+  for (Arena *arena = arenas_; arena; arena = arena->next_) {
+    if (arena->contains(ptr)) {
+      return arena;
+    }
+  }
+  return NULL;
+}
+
+void *Arena::allocate(size_t size) {
+  uintptr_t base = (uintptr_t) memory_;
+  size_t start = ((base + used_ + ARENA_ALIGNMENT - 1) & ~(uintptr_t) (ARENA_ALIGNMENT - 1)) - base;
+  if (start > size_ || size > size_ - start) {
+    return NULL;
+  }
+  last_ = start;
+  used_ = start + size;
+  highWaterMark_ = max(highWaterMark_, used_);
+  return memory_ + start;
+}
+
+void *Arena::reallocate(void *ptr, size_t oldSize, size_t newSize) {
+  if (ptr == memory_ + last_ && used_ > 0 && newSize <= size_ - last_) {
+    used_ = last_ + newSize;
+    highWaterMark_ = max(highWaterMark_, used_);
+    return ptr;
+  }
+  void *moved = allocate(newSize);
+  if (moved && ptr) {
+    memcpy(moved, ptr, min(oldSize, newSize));
+  }
+  return moved;
+}
+
+void Arena::release(void *ptr) {
+  if (ptr == memory_ + last_ && used_ > 0) {
+    used_ = last_;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Utf8
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef SCREENUI_ROM_A02
+// Characters in the A00 ROM outside of ASCII and half width katakana, and
+// their codes, sorted by codepoint.
+static const uint16_t romCodepoints[] PROGMEM = {
+  0x00a2, 0x00a5, 0x00b0, 0x00e4, 0x00f1, 0x00f6, 0x00f7, 0x00fc, 0x0398,
+  0x03a3, 0x03a9, 0x03b1, 0x03b2, 0x03b5, 0x03b8, 0x03bc, 0x03c0, 0x03c1,
+  0x03c3, 0x2190, 0x2192, 0x221a, 0x221e, 0x2588, 0x3001, 0x300c, 0x300d
+};
+static const uint8_t romCodes[] PROGMEM = {
+  0xec, 0x5c, 0xdf, 0xe1, 0xee, 0xef, 0xfd, 0xf5, 0xf2,
+  0xf6, 0xf4, 0xe0, 0xe2, 0xe3, 0xf2, 0xe4, 0xf7, 0xe6,
+  0xe5, 0x7f, 0x7e, 0xe8, 0xf3, 0xff, 0xa4, 0xa2, 0xa3
+};
+#endif
+
+uint16_t Utf8::customChars_[8];
+// Slot 7 is loaded with the check mark by every Screen.
+uint8_t Utf8::reservedSlots_ = 0x80;
+
+bool Utf8::mapCustomChar(uint16_t codepoint, uint8_t slot) {
+  if (slot == 0 || slot > 7 || codepoint == 0 || (reservedSlots_ & (1 << slot))) {
+    return false;
+  }
+  customChars_[slot] = codepoint;
+  return true;
+}
+
+bool Utf8::reserveCustomChars(uint8_t slots) {
+  for (uint8_t slot = 0; slot < 8; slot++) {
+    if ((slots & (1 << slot)) && customChars_[slot]) {
+      return false;
+    }
+  }
+  reservedSlots_ |= slots;
+  return true;
+}
+
+uint8_t Utf8::displayCode(uint16_t codepoint) {
+  for (uint8_t slot = 1; slot < 8; slot++) {
+    if (customChars_[slot] && customChars_[slot] == codepoint) {
+      return slot;
+    }
+  }
+  #ifdef SCREENUI_ROM_A02
+  // The A02 ROM follows Latin-1 from 0xa0 up.
+  if (codepoint >= 0xa0 && codepoint <= 0xff) {
+    return codepoint;
+  }
+  #else
+  if (codepoint >= 0xff61 && codepoint <= 0xff9f) {
+    return codepoint - 0xff61 + 0xa1;
+  }
+  int low = 0;
+  int high = sizeof(romCodes) - 1;
+  while (low <= high) {
+    int middle = (low + high) / 2;
+    uint16_t c = screenui_read_word(&romCodepoints[middle]);
+    if (c == codepoint) {
+      return screenui_read_byte(&romCodes[middle]);
+    }
+    else if (c < codepoint) {
+      low = middle + 1;
+    }
+    else {
+      high = middle - 1;
+    }
+  }
+  #endif
+  return '?';
+}
+
+uint16_t Utf8::codepoint(uint8_t code) {
+  #ifdef SCREENUI_ROM_A02
+  if ((code >= ' ' && code < 0x7f) || code >= 0xa0) {
+    return code;
+  }
+  #else
+  // The table holds a few codes in the katakana range, so it goes first.
+  for (uint8_t i = 0; i < sizeof(romCodes); i++) {
+    if (screenui_read_byte(&romCodes[i]) == code) {
+      return screenui_read_word(&romCodepoints[i]);
+    }
+  }
+  if (code >= ' ' && code < 0x7f) {
+    return code;
+  }
+  if (code >= 0xa1 && code <= 0xdf) {
+    return code - 0xa1 + 0xff61;
+  }
+  #endif
+  return 0;
+}
+
+uint8_t Utf8::transcode(const char *text, char *display) {
+  uint8_t length = 0;
+  const uint8_t *p = (const uint8_t *) text;
+  while (*p) {
+    uint8_t ch = *p++;
+    if (ch < 0x80) {
+      display[length++] = ch;
+      continue;
+    }
+    // The number of continuation bytes and the bits of the first byte.
+    uint8_t continuation = ch >= 0xf0 ? 3 : ch >= 0xe0 ? 2 : ch >= 0xc0 ? 1 : 0;
+    uint32_t codepoint = ch & (0x3f >> continuation);
+    for (; continuation && (*p & 0xc0) == 0x80; continuation--) {
+      codepoint = (codepoint << 6) | (*p++ & 0x3f);
+    }
+    // Stray continuation bytes, truncated sequences, overlong encodings of
+    // NUL and characters beyond the first plane can't be displayed.
+    if (continuation || ch < 0xc0 || codepoint == 0 || codepoint > 0xffff) {
+      display[length++] = '?';
+    }
+    else {
+      display[length++] = displayCode(codepoint);
+    }
+  }
+  display[length] = 0;
+  return length;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // CharSet
 ////////////////////////////////////////////////////////////////////////////////
@@ -22,13 +22,82 @@
 #ifndef __ScreenUi_h__
 #define __ScreenUi_h__
 
+#include <stddef.h>
 #include <stdint.h>
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#elif defined(ARDUINO) && defined(__has_include)
+#if __has_include(<pgmspace.h>)
+#include <pgmspace.h>
+#elif __has_include(<avr/pgmspace.h>)
+#include <avr/pgmspace.h>
+#endif
+#endif
 
 //#define SCREENUI_DEBUG 1
 
+// Which character ROM the display has, used to convert UTF-8 text. HD44780
+// compatible displays usually have the Japanese A00 ROM. Define this for
+// displays with the European A02 ROM.
+//#define SCREENUI_ROM_A02 1
+
+// Component positions and sizes, and the number of Components in a
+// Container, are 8 bits to save RAM. Define this to make them 16 bits, for
+// large terminals or ScrollContainers with more than 255 Components or rows
+// past y = 127.
+//#define SCREENUI_WIDE_COORDINATES 1
+
+// Screen's hardware methods, like Screen::draw(), are normally defined by the
+// main program for its display. Define this to have the library define them
+// as doing nothing, for programs whose only Screens are backends that
+// override them, like TerminalScreen or SharedMemoryScreen on a host. The
+// program can still define any of them itself.
+//#define SCREENUI_DEFAULT_HARDWARE 1
+
 #define min(a,b) ((a)<(b)?(a):(b))
 #define max(a,b) ((a)>(b)?(a):(b))
 
+// Fails to compile if cond is false.
+#define SCREENUI_STATIC_ASSERT(cond, name) typedef char name[(cond) ? 1 : -1]
+
+#ifdef SCREENUI_WIDE_COORDINATES
+typedef int16_t screen_coord_t;
+typedef uint16_t screen_size_t;
+typedef uint16_t screen_count_t;
+#define SCREEN_COORD_MIN -32768
+#define SCREEN_COORD_MAX 32767
+#define SCREEN_COUNT_MAX 65535
+#else
+typedef int8_t screen_coord_t;
+typedef uint8_t screen_size_t;
+typedef uint8_t screen_count_t;
+#define SCREEN_COORD_MIN -128
+#define SCREEN_COORD_MAX 127
+#define SCREEN_COUNT_MAX 255
+#endif
+
+// Tables that are only read, like Menu entries, are kept in flash and read
+// with these wherever pgmspace.h is available, since flash can't always be
+// read like RAM, such as on AVR and ESP8266. Elsewhere PROGMEM does nothing
+// and they are read directly.
+#ifdef pgm_read_byte
+#define screenui_read_byte(p) pgm_read_byte(p)
+#define screenui_read_word(p) pgm_read_word(p)
+#ifdef pgm_read_ptr
+#define screenui_read_ptr(p) ((const void *) pgm_read_ptr(p))
+#else
+#define screenui_read_ptr(p) ((const void *) (uintptr_t) \
+    (sizeof(void *) == 2 ? pgm_read_word(p) : pgm_read_dword(p)))
+#endif
+#else
+#define screenui_read_byte(p) (*(const uint8_t *) (p))
+#define screenui_read_word(p) (*(const uint16_t *) (p))
+#define screenui_read_ptr(p) (*(const void * const *) (p))
+#endif
+#ifndef PROGMEM
+#define PROGMEM
+#endif
+
 class Screen;
 
 // Represents a set of characters that can be mapped to a continuous sequence
@@ -64,20 +133,121 @@ class RangeCharSet : public CharSet {
 extern RangeCharSet defaultCharSet;
 extern RangeCharSet floatingPointCharSet;
 
+// Converts UTF-8 text to the character codes of the display's ROM, using
+// tables kept in flash. Characters the ROM doesn't have are shown as '?',
+// unless they have been mapped to a custom character.
+class Utf8 {
+  public:
+    // Converts text into display, which must be at least as long as text,
+    // and returns the number of characters on the display.
+    static uint8_t transcode(const char *text, char *display);
+    // Displays codepoint using custom character slot 1-6. Slot 0 can't be
+    // used since it would end the string, slot 7 holds Checkbox's check mark
+    // and slots 0-6 hold the glyphs of BarGraph and Sparkline once one has
+    // been painted. Returns false if the slot is used by the library or
+    // codepoint is 0.
+    static bool mapCustomChar(uint16_t codepoint, uint8_t slot);
+    // Marks the slots in the mask as used by the library. Returns false,
+    // reserving nothing, if any of them is mapped to a codepoint.
+    static bool reserveCustomChars(uint8_t slots);
+    // Returns the codepoint of the character shown for code from the
+    // display's ROM, or 0 if it isn't known.
+    static uint16_t codepoint(uint8_t code);
+  private:
+    static uint8_t displayCode(uint16_t codepoint);
+
+    // The codepoint mapped to each slot, or 0.
+    static uint16_t customChars_[8];
+    static uint8_t reservedSlots_;
+};
+
+// A block of memory that Components can be created in and then released all
+// at once, instead of being allocated and freed one at a time on the heap.
+// Create Components in an Arena with new (arena) Label("Text"). The memory
+// a Component allocates for itself, such as a Container's list of children,
+// comes from the Arena the Component is in, so it goes when the Arena is
+// reset.
+// A typical use is to build a Screen and its Components in an Arena, show
+// the Screen, and then reset() the Arena when the Screen closes.
+// Components in an Arena are never deleted, so their destructors don't run.
+class Arena {
+  public:
+    // Create an Arena that uses the given memory.
+    Arena(void *memory, size_t size);
+    // Create an Arena that allocates size bytes from the heap.
+    Arena(size_t size);
+    virtual ~Arena();
+    // Returns size bytes from the Arena, or NULL if there is not enough left.
+    void *allocate(size_t size);
+    // Grows an allocation, in place if it was the last one made.
+    void *reallocate(void *ptr, size_t oldSize, size_t newSize);
+    // Returns true if ptr points in to the Arena's memory.
+    bool contains(const void *ptr) { return (const uint8_t *) ptr >= memory_ && (const uint8_t *) ptr < memory_ + size_; }
+    // Releases everything allocated from the Arena.
+    void reset() { used_ = last_ = 0; }
+    // Releases ptr if it was the last allocation, so that a buffer that is
+    // only needed for a moment doesn't use up the Arena. Anything else is
+    // only released by reset().
+    void release(void *ptr);
+    // Returns the Arena that ptr was allocated from, or NULL.
+    static Arena *find(const void *ptr);
+    size_t size() { return size_; }
+    size_t used() { return used_; }
+    // Returns the most memory that has ever been used at once, which can be
+    // used to size the Arena.
+    size_t highWaterMark() { return highWaterMark_; }
+  private:
+    uint8_t *memory_;
+    size_t size_;
+    size_t used_;
+    // Where the last allocation starts, so it can be grown in place.
+    size_t last_;
+    size_t highWaterMark_;
+    bool owned_;
+    // Every Arena, so memory can be recognized when it is freed.
+    Arena *next_;
+    static Arena *arenas_;
+};
+
+// Allocates an object from the Arena. If the Arena is full this returns NULL
+// and the constructor is not run, so the result must be checked.
+void *operator new(size_t size, Arena &arena) throw();
+
+class Component;
+
+// Events that Components record when the user changes them.
+enum {
+  // A Button was pressed, or a Menu entry with an action was chosen.
+  EVENT_PRESSED = 1,
+  // A Checkbox was checked or unchecked.
+  EVENT_TOGGLED,
+  // The value of a List, Spinner or Input was changed.
+  EVENT_VALUE_CHANGED,
+  // The Component received focus.
+  EVENT_FOCUS_CHANGED
+};
+
+struct ScreenEvent {
+  Component *component;
+  uint8_t type;
+};
+
+#define SCREEN_MAX_EVENTS 8
+
 class Component {
   public:
-    Component() { x_ = y_ = width_ = height_ = 0; }
+    Component() { x_ = y_ = width_ = height_ = flags_ = 0; }
     // Set the location on screen for this component. x and y are zero based,
     // absolute character positions.
-    virtual void setLocation(int8_t x, int8_t y) { x_ = x; y_ = y;}
+    virtual void setLocation(screen_coord_t x, screen_coord_t y) { x_ = x; y_ = y;}
     // Set the width and height this component. Most components will either
     // require a width and height to be specified during creation or will
     // adopt sane defaults based on their input data.
-    void setSize(uint8_t width, uint8_t height) { width_ = width; height_ = height; }
-    int8_t x() { return x_; }
-    int8_t y() { return y_; }
-    uint8_t width() { return width_; }
-    uint8_t height() { return height_; }
+    void setSize(screen_size_t width, screen_size_t height) { width_ = width; height_ = height; }
+    screen_coord_t x() { return x_; }
+    screen_coord_t y() { return y_; }
+    screen_size_t width() { return width_; }
+    screen_size_t height() { return height_; }
     // Returns true if the component is willing to accept focus from the focus
     // subsystem. For a component to receive input events it must be willing
     // to accept focus.
@@ -109,15 +279,40 @@ class Component {
     // Sets dirty to true for this Component, causing it to be painted during
     // the next update.
     // TODO refactor the two below into setDirty()
-    virtual void repaint() { dirty_ = true; }
-    virtual void clearDirty() { dirty_ = false; }
+    virtual void repaint() { setFlag(DIRTY, true); }
+    virtual void clearDirty() { setFlag(DIRTY, false); }
+    // Returns the number of bytes saveState() needs to store the Component's
+    // value, or 0 if the Component has no value to save. Used by
+    // StateSnapshot.
+    virtual uint8_t stateSize() { return 0; }
+    // Stores the Component's value in data, which is stateSize() bytes long.
+    virtual void saveState(uint8_t *data) {}
+    // Sets the Component's value from data stored by saveState().
+    virtual void restoreState(const uint8_t *data) {}
     #ifdef SCREENUI_DEBUG
     virtual char *description() { return "Component"; }
     #endif
 	protected:
-		int8_t x_, y_;
-		uint8_t width_, height_;
-		bool dirty_;
+    // Bits of flags_. Each subclass declares its own bits in the same way,
+    // starting from its parent's NEXT_FLAG, so a class's bits can't collide
+    // with those of the classes it is built on. Unrelated classes reuse the
+    // same bits.
+    enum {
+      DIRTY = 0x01,
+      NEXT_FLAG = 0x02
+    };
+    // Records an event for this Component with the Screen being updated.
+    // Does nothing outside of Screen::update(), so changes the program makes
+    // itself are not reported back to it.
+    void postEvent(uint8_t type);
+    bool flag(uint8_t mask) { return flags_ & mask; }
+    void setFlag(uint8_t mask, bool value) { flags_ = value ? (flags_ | mask) : (flags_ & ~mask); }
+
+		screen_coord_t x_, y_;
+		screen_size_t width_, height_;
+		// Every bool a Component needs is packed in to this byte, since there
+		// can be many Components and very little RAM.
+		uint8_t flags_;
 };
 
 // A Component that contains other Components. Users should not generally
@@ -126,7 +321,7 @@ class Container : public Component {
   public:
     Container();
     virtual ~Container();
-    virtual void add(Component *component, int8_t x, int8_t y);
+    virtual void add(Component *component, screen_coord_t x, screen_coord_t y);
     virtual void update(Screen *screen);
     // Paints any dirty child components.
     virtual void paint(Screen *screen);
@@ -143,12 +338,34 @@ class Container : public Component {
   protected:
     Component *nextFocusHolder(Component *focusHolder, bool reverse);
     Component *nextFocusHolder(Component *focusHolder, bool reverse, bool *focusHolderFound);
+    // An entry in Screen's focus index. block is the outermost Container the
+    // Component is in that scrolls, or NULL. Everything in a block moves
+    // together when it scrolls, so the order of the index doesn't change.
+    struct FocusEntry {
+      Component *component;
+      Container *block;
+    };
+    // Returns true if the Container moves its children to scroll them.
+    virtual bool scrolls() { return false; }
+    // Stores every Component that accepts focus in entries, in tree order,
+    // and returns how many there are. entries may be NULL to just count them.
+    screen_count_t collectFocusHolders(FocusEntry *entries, Container *block);
     void offsetChildren(int x, int y);
 
+    enum {
+      FIRST_UPDATE_COMPLETED = Component::NEXT_FLAG,
+      NEXT_FLAG = FIRST_UPDATE_COMPLETED << 1
+    };
+    SCREENUI_STATIC_ASSERT(NEXT_FLAG <= 0x100, flagsFit);
+
+    // Changed whenever any Container adds a Component or places its children
+    // on the first update, so Screen knows when its focus index is out of
+    // date. Scrolling doesn't change it.
+    static uint16_t layoutVersion_;
+
     Component **components_;
-    uint8_t componentsLength_;
-    uint8_t componentCount_;
-    bool firstUpdateCompleted_;
+    screen_count_t componentsLength_;
+    screen_count_t componentCount_;
 };
 
 // The main entry point into the ScreenUi system. A Screen instance represents
@@ -162,6 +379,7 @@ class Container : public Component {
 class Screen : public Container {
   public:
     Screen(uint8_t width, uint8_t height);
+    virtual ~Screen();
     // Should be called regularly by the main program to update the Screen
     // and process input. After each call to update(), each Component
     // will have processed any input it received and will have updated it
@@ -173,14 +391,52 @@ class Screen : public Container {
     // Sets the current focus holder. This can be used to set the default
     // button on a screen before it is displayed, for instance.
     void setFocusHolder(Component *focusHolder) { focusHolder_ = focusHolder; }
+    // By default focus moves through the Components in the order they were
+    // added, using the y axis of the input. With spatial focus, y moves focus
+    // to the nearest Component in the row above or below and x moves to the
+    // next Component to the left or right, which suits screens laid out as a
+    // grid and a four way input.
+    void setSpatialFocus(bool spatialFocus) { spatialFocus_ = spatialFocus; }
     void setCursorLocation(uint8_t x, uint8_t y) { cursorX_ = x; cursorY_ = y; }
+    // Loads the partial block glyphs used by BarGraph and Sparkline into
+    // custom character slots 0-6. The glyphs are only loaded the first time
+    // this is called, so components can call it from every paint. Returns
+    // false if Utf8 has mapped any of those slots, in which case the graphs
+    // are drawn with whole blocks only.
+    bool loadLevelGlyphs();
+    // Sets the time in milliseconds, for Components that animate, like
+    // MarqueeLabel. The main program should call this with millis()
+    // before each update(). Nothing animates if it is never called.
+    void setTime(uint32_t time) { time_ = time; }
+    uint32_t time() { return time_; }
+    // Called by Components during update() to ask for another update at the
+    // given time.
+    void requestUpdate(uint32_t time);
+    // Returns how many milliseconds after the time given to setTime() a
+    // Component next needs an update, or 0xffffffff if none has asked for
+    // one. The main program can sleep this long, or until there is input,
+    // instead of calling update() continuously.
+    uint32_t idleTime();
+    // Returns true if there are events waiting, so the main program only has
+    // to look at its Components when something changed.
+    bool hasEvents() { return eventCount_ != 0; }
+    // Takes the oldest waiting event. Returns false if there are none. Only
+    // the most recent SCREEN_MAX_EVENTS events are kept.
+    bool nextEvent(ScreenEvent *event);
+    // Sets a function that is called with each event at the end of update(),
+    // instead of keeping them for nextEvent().
+    void setEventHandler(void (*handler)(Screen *screen, const ScreenEvent *event)) { eventHandler_ = handler; }
+    // Adds an event to the queue. Components use Component::postEvent().
+    void postEvent(Component *component, uint8_t type);
+    // Returns the Screen that is running update(), if any.
+    static Screen *updating() { return updating_; }
 
     #ifdef SCREENUI_DEBUG
     virtual char *description() { return "Screen"; }
     #endif
     
     // The following methods must be overridden by the user to provide
-    // hardware support
+    // hardware support, unless SCREENUI_DEFAULT_HARDWARE is defined
     
     // Get any changes in the input since the last call to update();
     virtual void getInputDeltas(int *x, int *y, bool *selected, bool *cancelled);
@@ -192,31 +448,460 @@ class Screen : public Container {
     virtual void setCursorVisible(bool visible);
     virtual void setBlink(bool blink);
     virtual void moveCursor(uint8_t x, uint8_t y);
+    // Called at the end of every update(), after the cursor has been moved,
+    // once the frame is complete. Screens that buffer their output send it
+    // here. Unlike the methods above it does nothing by default.
+    virtual void endUpdate() {}
 
   private:
+    // Returns the Component that focus moves to from the focus holder for
+    // the given input, using the focus index.
+    Component *spatialFocusHolder(int x, int y);
+    // The order of the focus index. A block takes the place of the rows it
+    // covers on the screen, with its own rows in order inside it, so rows
+    // that are scrolled out of view are still reached in order.
+    static bool focusBefore(const FocusEntry &a, const FocusEntry &b);
+    static bool sameRow(const FocusEntry &a, const FocusEntry &b);
+
     bool cleared_;
     Component *focusHolder_;
     bool focusHolderSelected_;
     bool annoyingBugWorkedAround_;
+    bool levelGlyphsLoaded_;
+    uint8_t cursorX_, cursorY_;
+    bool spatialFocus_;
+    uint32_t time_;
+    // The earliest time asked for by requestUpdate() during this update.
+    uint32_t deadline_;
+    bool deadlineRequested_;
+    ScreenEvent events_[SCREEN_MAX_EVENTS];
+    uint8_t eventHead_, eventCount_;
+    void (*eventHandler_)(Screen *screen, const ScreenEvent *event);
+    static Screen *updating_;
+    // Every Component that accepts focus, sorted by focusBefore(), so that
+    // spatial focus moves only have to look at the rows next to the focus
+    // holder. Rebuilt when layoutVersion_ changes.
+    FocusEntry *focusIndex_;
+    screen_count_t focusIndexCount_;
+    uint16_t focusIndexVersion_;
+    // Where the focus holder was in the index after the last move, so it
+    // usually doesn't have to be searched for.
+    screen_count_t focusIndexPosition_;
+};
+
+// A Screen that drives a serial terminal using ANSI escape sequences, for
+// mirroring the user interface to a remote console. The user should create a
+// subclass that implements write() to send bytes to the terminal and
+// getInputDeltas() to provide input.
+// TerminalScreen tracks where the terminal's cursor is and what it looks
+// like, so that a draw() that starts where the last one ended costs nothing
+// extra and a move uses the shortest of a carriage return, a relative move or
+// an absolute position. Output is buffered and written once per update.
+// Characters from the display's ROM are sent as UTF-8, and those with no
+// known codepoint as '?'.
+class TerminalScreen : public Screen {
+  public:
+    TerminalScreen(uint8_t width, uint8_t height);
+    // Must be implemented by the user to send bytes to the terminal.
+    virtual void write(const uint8_t *data, uint8_t length) = 0;
+    // Sets the character that is sent in place of the given custom
+    // character, since terminals cannot display them. Otherwise one with
+    // about as much ink as the glyph is picked whenever the slot is loaded.
+    void setCustomCharSubstitute(uint8_t slot, char ch) {
+      customChars_[slot & 7] = ch;
+      substitutedSlots_ |= 1 << (slot & 7);
+    }
+    // Writes any buffered output to the terminal.
+    void flush();
+
+    virtual void clear();
+    virtual void createCustomChar(uint8_t slot, uint8_t *data);
+    virtual void draw(uint8_t x, uint8_t y, const char *text);
+    virtual void draw(uint8_t x, uint8_t y, uint8_t customChar);
+    virtual void setCursorVisible(bool visible);
+    virtual void setBlink(bool blink);
+    virtual void moveCursor(uint8_t x, uint8_t y);
+    virtual void endUpdate();
+    #ifdef SCREENUI_DEBUG
+    virtual char *description() { return "TerminalScreen"; }
+    #endif
+  private:
+    // Moves the terminal's cursor to x, y using the fewest bytes.
+    void moveTo(uint8_t x, uint8_t y);
+    void put(char ch);
+    void putNumber(uint8_t n);
+    void putSequence(uint8_t n, char command);
+    // Sends the cursor visibility and style for the current cursor state.
+    void updateCursor();
+
+    char customChars_[8];
+    // The slots whose substitute was set by setCustomCharSubstitute(), and
+    // isn't replaced when a glyph is loaded in to them.
+    uint8_t substitutedSlots_;
+    uint8_t buffer_[32];
+    uint8_t bufferLength_;
+    // The terminal's cursor position, or 0xff when it is not known.
+    uint8_t terminalX_, terminalY_;
+    bool cursorVisible_, blink_;
+    // The cursor visibility and style last sent to the terminal, or 0xff
+    // when they are not known.
+    uint8_t terminalCursorShown_, terminalCursorStyle_;
+};
+
+// Trace records. A trace starts with the bytes 'S' 'U' 'T', the format
+// version, and the Screen's width and height. It is followed by records that
+// each start with one of the types below. Coordinates, lengths, characters
+// and flags are single bytes. Times and input deltas are stored as variable
+// length integers, 7 bits per byte with the high bit set on every byte but the
+// last. Input deltas are zigzag encoded first.
+#define SCREENUI_TRACE_VERSION 2
+enum {
+  // Time since the previous update started and how long update() took,
+  // both in microseconds, and how far the Screen's time() had moved on
+  // since the previous update, in milliseconds. Ends the records for one
+  // update.
+  TRACE_FRAME = 1,
+  // x, y, and a byte with bit 0 for selected and bit 1 for cancelled.
+  // Only recorded when there was input.
+  TRACE_INPUT,
+  // x, y, length and the text.
+  TRACE_TEXT,
+  // x, y and the custom character.
+  TRACE_CHAR,
+  // x and y.
+  TRACE_MOVE_CURSOR,
+  TRACE_CURSOR_VISIBLE,
+  TRACE_BLINK,
+  TRACE_CLEAR,
+  // The slot and 8 bytes of glyph data.
+  TRACE_CUSTOM_CHAR
+};
+
+// A Screen that records a trace of its input and output while passing both
+// through to the user's Screen implementation. The trace can be fed back
+// through the same Components with TraceReplayer to reproduce a session on
+// a host and check that a change didn't alter what is drawn.
+// The user should create a subclass that implements writeTrace() to store
+// the trace and now() to time each update(). The time given to setTime() is
+// recorded too, so that animations replay as they were recorded.
+class TraceRecorder : public Screen {
+  public:
+    TraceRecorder(uint8_t width, uint8_t height);
+    // Must be implemented by the user to store the next bytes of the trace.
+    virtual void writeTrace(const uint8_t *data, uint8_t length) = 0;
+    // Must be implemented by the user to return a time in microseconds.
+    virtual uint32_t now() = 0;
+
+    virtual void update();
+    virtual void getInputDeltas(int *x, int *y, bool *selected, bool *cancelled);
+    virtual void clear();
+    virtual void createCustomChar(uint8_t slot, uint8_t *data);
+    virtual void draw(uint8_t x, uint8_t y, const char *text);
+    virtual void draw(uint8_t x, uint8_t y, uint8_t customChar);
+    virtual void setCursorVisible(bool visible);
+    virtual void setBlink(bool blink);
+    virtual void moveCursor(uint8_t x, uint8_t y);
+    #ifdef SCREENUI_DEBUG
+    virtual char *description() { return "TraceRecorder"; }
+    #endif
+  private:
+    bool started_;
+    uint32_t lastUpdate_;
+    // The Screen's time() during the last update.
+    uint32_t lastTime_;
+};
+
+// A Screen that replays the input from a trace made by TraceRecorder through
+// the Components added to it, and compares what they draw with what was
+// recorded. After each update() the contents of the screen and the cursor
+// are compared with the recorded frame. The number of bytes drawn and the
+// time taken by update() are totalled for both so a change can be measured
+// against a real session. The Screen's time() is set from the trace before
+// each update.
+// The user should create a subclass that implements now(), add the same
+// Components the trace was recorded with and call update() until finished()
+// returns true.
+class TraceReplayer : public Screen {
+  public:
+    TraceReplayer(const uint8_t *trace, uint32_t length);
+    virtual ~TraceReplayer();
+    // Must be implemented by the user to return a time in microseconds.
+    virtual uint32_t now() = 0;
+    // Returns false if the trace is not one that can be replayed.
+    bool valid() { return position_ != 0; }
+    // Returns true once every frame in the trace has been replayed.
+    bool finished() { return position_ >= length_; }
+    uint32_t frames() { return frames_; }
+    // The number of frames where the screen did not match the recording, and
+    // the first of them, counting from 1.
+    uint32_t mismatchedFrames() { return mismatchedFrames_; }
+    uint32_t firstMismatchedFrame() { return firstMismatchedFrame_; }
+    // The number of characters drawn, as recorded and as replayed.
+    uint32_t recordedDrawBytes() { return recordedDrawBytes_; }
+    uint32_t replayedDrawBytes() { return replayedDrawBytes_; }
+    // The total time spent in update() in microseconds, as recorded and as
+    // replayed.
+    uint32_t recordedUpdateTime() { return recordedUpdateTime_; }
+    uint32_t replayedUpdateTime() { return replayedUpdateTime_; }
+
+    virtual void update();
+    virtual void getInputDeltas(int *x, int *y, bool *selected, bool *cancelled);
+    virtual void clear();
+    virtual void createCustomChar(uint8_t slot, uint8_t *data);
+    virtual void draw(uint8_t x, uint8_t y, const char *text);
+    virtual void draw(uint8_t x, uint8_t y, uint8_t customChar);
+    virtual void setCursorVisible(bool visible);
+    virtual void setBlink(bool blink);
+    virtual void moveCursor(uint8_t x, uint8_t y);
+    #ifdef SCREENUI_DEBUG
+    virtual char *description() { return "TraceReplayer"; }
+    #endif
+  private:
+    // The state of the screen. One is built from the trace and the other from
+    // the Components being replayed.
+    struct Frame {
+      char *cells;
+      uint8_t cursorX, cursorY;
+      bool cursorVisible, blink;
+    };
+    void initFrame(Frame *frame);
+    void drawFrame(Frame *frame, uint8_t x, uint8_t y, uint8_t ch);
+    uint8_t readByte();
+    uint32_t readNumber();
+    int readSignedNumber();
+
+    const uint8_t *trace_;
+    uint32_t length_;
+    uint32_t position_;
+    Frame recorded_, replayed_;
+    int inputX_, inputY_;
+    bool inputSelected_, inputCancelled_;
+    uint32_t frames_, mismatchedFrames_, firstMismatchedFrame_;
+    uint32_t recordedDrawBytes_, replayedDrawBytes_;
+    uint32_t recordedUpdateTime_, replayedUpdateTime_;
+};
+
+#define MIRROR_MAX_OUTPUTS 3
+
+// A Screen that paints the user interface once, in to a frame in memory, and
+// mirrors that frame to several other Screens, such as the local LCD and a
+// TerminalScreen on a slow serial link. Each output keeps a copy of what it
+// is showing and is only sent the cells that differ from the frame. An output
+// can be flushed at most once every interval milliseconds, and sent at most
+// a given number of characters per flush, so a slow output doesn't hold up a
+// fast one. Changes made between flushes are merged, so a slow output always
+// skips straight to the latest frame.
+// The user should create a subclass that implements getInputDeltas(), and
+// call setTime() before each update(), since outputs with an interval are
+// only flushed again as time() moves on. While an output has changes it
+// hasn't been sent, the MirrorScreen asks for an update when the output is
+// next due, so idleTime() never sleeps past it. The outputs only have their
+// hardware methods and endUpdate() called; they are never updated
+// themselves.
+class MirrorScreen : public Screen {
+  public:
+    MirrorScreen(uint8_t width, uint8_t height);
+    virtual ~MirrorScreen();
+    // Returns false if there was no memory for the frame.
+    bool valid() { return cells_ != NULL; }
+    // Adds an output. An interval of 0 flushes it at the end of every update
+    // and a limit of 0 characters sends every change at once. The limit only
+    // counts the characters drawn: each run of changed cells also costs the
+    // output a cursor move, which a TerminalScreen sends as an escape sequence
+    // of up to 8 bytes, so leave room for those on a slow link. Custom
+    // characters already created are sent to the new output straight away.
+    // Returns false if MIRROR_MAX_OUTPUTS outputs have already been added or
+    // there is no memory for a copy of what the output shows.
+    bool addOutput(Screen *screen, uint16_t interval, uint8_t characters);
+    // Sends every outstanding change to every output, ignoring their
+    // intervals and character limits.
+    void flush();
+
+    virtual void clear();
+    virtual void createCustomChar(uint8_t slot, uint8_t *data);
+    virtual void draw(uint8_t x, uint8_t y, const char *text);
+    virtual void draw(uint8_t x, uint8_t y, uint8_t customChar);
+    virtual void setCursorVisible(bool visible);
+    virtual void setBlink(bool blink);
+    virtual void moveCursor(uint8_t x, uint8_t y);
+    virtual void endUpdate();
+    #ifdef SCREENUI_DEBUG
+    virtual char *description() { return "MirrorScreen"; }
+    #endif
+  private:
+    struct Output {
+      Screen *screen;
+      // What the output is showing, once it has been cleared.
+      char *cells;
+      bool cleared;
+      uint16_t interval;
+      uint8_t characters;
+      uint32_t lastFlush;
+      // The cell the next flush starts looking for changes at, so that a
+      // limit smaller than a frame doesn't leave the bottom rows stale.
+      uint16_t position;
+      // The cursor last sent to the output, or 0xff when it is not known.
+      uint8_t cursorX, cursorY, cursorVisible, blink;
+    };
+    void flushOutput(Output *output, uint16_t characters);
+    // Returns true if the output isn't showing the latest frame.
+    bool pending(Output *output);
+
+    // The frame the Components paint in to.
+    char *cells_;
+    // The custom characters created so far, for outputs added later.
+    uint8_t glyphs_[8][8];
+    uint8_t glyphsCreated_;
+    Output outputs_[MIRROR_MAX_OUTPUTS];
+    uint8_t outputCount_;
     uint8_t cursorX_, cursorY_;
+    bool cursorVisible_, blink_;
+};
+
+#ifdef __linux__
+// The layout of the shared memory segment written by SharedMemoryScreen. It
+// is followed by width * height characters, row by row.
+// sequence is odd while the frame is being changed. Readers copy what they
+// need and then check that sequence was even and didn't change while they
+// did, trying again if it did. SharedFrameReader does this.
+#define SCREENUI_SHARED_VERSION 1
+struct SharedFrame {
+  // 'S' 'U' 'F' and SCREENUI_SHARED_VERSION.
+  uint8_t magic[4];
+  uint32_t sequence;
+  uint8_t width, height;
+  uint8_t cursorX, cursorY;
+  uint8_t cursorVisible, blink;
+  uint8_t reserved[2];
+  // The 5x8 glyphs of the custom characters, one byte per row.
+  uint8_t glyphs[8][8];
 };
 
+// A Screen that publishes its characters, cursor and custom character
+// glyphs in a POSIX shared memory segment, so that other processes on a
+// Linux host, like a web dashboard or a screenshot tool, can show exactly
+// what is on the display. Components draw straight in to the segment, and
+// the frame is marked complete at the end of each update(), so the UI never
+// copies or waits for readers.
+// The user should create a subclass that implements getInputDeltas(). It is
+// often also added to a MirrorScreen along with the real display.
+class SharedMemoryScreen : public Screen {
+  public:
+    // name is passed to shm_open(), so it should start with a '/'. It is
+    // not copied. The segment is removed when the Screen is destroyed.
+    SharedMemoryScreen(uint8_t width, uint8_t height, const char *name);
+    virtual ~SharedMemoryScreen();
+    // Returns false if the segment could not be created.
+    bool valid() { return frame_ != NULL; }
+
+    virtual void clear();
+    virtual void createCustomChar(uint8_t slot, uint8_t *data);
+    virtual void draw(uint8_t x, uint8_t y, const char *text);
+    virtual void draw(uint8_t x, uint8_t y, uint8_t customChar);
+    virtual void setCursorVisible(bool visible);
+    virtual void setBlink(bool blink);
+    virtual void moveCursor(uint8_t x, uint8_t y);
+    virtual void endUpdate();
+    #ifdef SCREENUI_DEBUG
+    virtual char *description() { return "SharedMemoryScreen"; }
+    #endif
+  private:
+    // Makes sequence odd, if it isn't already, before the frame is changed.
+    void beginChange();
+
+    const char *name_;
+    SharedFrame *frame_;
+    char *cells_;
+};
+
+// Reads the frames published by a SharedMemoryScreen in another process.
+class SharedFrameReader {
+  public:
+    SharedFrameReader(const char *name);
+    ~SharedFrameReader();
+    // Returns false if the segment doesn't exist or isn't one we understand.
+    bool valid() { return frame_ != NULL; }
+    uint8_t width() { return frame_->width; }
+    uint8_t height() { return frame_->height; }
+    // Returns the sequence of the last complete frame, which changes after
+    // every update that changed something.
+    uint32_t sequence();
+    // Copies a complete frame in to frame and its characters in to cells,
+    // which must have room for width() * height() characters. Returns false
+    // if the frame kept changing while it was being copied.
+    bool read(SharedFrame *frame, char *cells);
+  private:
+    SharedFrame *frame_;
+    size_t size_;
+};
+#endif
+
 // A Component that displays static text at a specific position. 
+// Text may be UTF-8. It is converted to the display's character codes once,
+// when it is set, so painting it costs the same as painting ASCII. ASCII text
+// is drawn straight from the caller's string, unless the Label has already
+// had to convert some.
 class Label : public Component {
   public:
     Label(const char *text);
-    virtual const char *text() { return (const char *) text_; }
+    virtual ~Label();
+    virtual const char *text();
     virtual void setText(const char *text);
     virtual void paint(Screen *screen);
     #ifdef SCREENUI_DEBUG
     virtual char *description() { return "Label"; }
     #endif
   protected:
+    enum {
+      CAPTURED = Component::NEXT_FLAG,
+      // Set when text_ points to a LabelText holding the converted text.
+      TRANSCODED = CAPTURED << 1,
+      NEXT_FLAG = TRANSCODED << 1
+    };
+    SCREENUI_STATIC_ASSERT(NEXT_FLAG <= 0x100, flagsFit);
+
+    // Returns the text as it is drawn.
+    const char *displayText();
+
     char* text_;
-    bool captured_;
     uint8_t dirtyWidth_;
 };
 
+// A Label limited to maxWidth characters. Text that doesn't fit scrolls
+// through the space, one character every interval milliseconds, using the
+// Screen's time(), with a few spaces before it repeats. Each step only
+// redraws the characters that change.
+class MarqueeLabel : public Label {
+  public:
+    MarqueeLabel(const char *text, uint8_t maxWidth, uint16_t interval);
+    // Changes the limit, or removes it if maxWidth is 0.
+    void setMaxWidth(uint8_t maxWidth, uint16_t interval);
+    virtual void setText(const char *text);
+    virtual void update(Screen *screen);
+    virtual void repaint();
+    virtual void paint(Screen *screen);
+    #ifdef SCREENUI_DEBUG
+    virtual char *description() { return "MarqueeLabel"; }
+    #endif
+  private:
+    enum {
+      SHIFTED = Label::NEXT_FLAG,
+      RESTART = SHIFTED << 1,
+      NEXT_FLAG = RESTART << 1
+    };
+    SCREENUI_STATIC_ASSERT(NEXT_FLAG <= 0x100, flagsFit);
+    // Returns the character at position i of the scrolling text, which
+    // repeats after a few spaces.
+    char marqueeChar(const char *text, uint8_t length, uint16_t i);
+
+    uint8_t maxWidth_;
+    // How many characters the text has scrolled.
+    uint8_t offset_;
+    uint16_t interval_;
+    // The low 16 bits of the time the text next scrolls.
+    uint16_t nextShift_;
+};
+
 // A Component that can receive focus and select events. If the Button has
 // focus when the user presses the select button the Button's pressed() property
 // is set indicating that the button was selected.
@@ -225,14 +910,18 @@ class Button : public Label {
   public:
     Button(const char *text);
     virtual bool acceptsFocus() { return true; }
-    bool pressed() { return pressed_; }
+    bool pressed() { return flag(PRESSED); }
     virtual void update(Screen *screen);
     virtual bool handleInputEvent(int x, int y, bool selected, bool cancelled);
     #ifdef SCREENUI_DEBUG
     virtual char *description() { return "Button"; }
     #endif
   private:
-    bool pressed_;
+    enum {
+      PRESSED = Label::NEXT_FLAG,
+      NEXT_FLAG = PRESSED << 1
+    };
+    SCREENUI_STATIC_ASSERT(NEXT_FLAG <= 0x100, flagsFit);
 };
 
 // A Component that displays either an on or off state. Clicking the component
@@ -240,14 +929,22 @@ class Button : public Label {
 class Checkbox : public Label {
   public:
     Checkbox();
-    bool checked() { return checked_; }
+    bool checked() { return flag(CHECKED); }
+    void setChecked(bool checked);
     virtual bool acceptsFocus() { return true; }
     virtual bool handleInputEvent(int x, int y, bool selected, bool cancelled);
+    virtual uint8_t stateSize() { return 1; }
+    virtual void saveState(uint8_t *data) { data[0] = flag(CHECKED); }
+    virtual void restoreState(const uint8_t *data) { setChecked(data[0]); }
     #ifdef SCREENUI_DEBUG
     virtual char *description() { return "Checkbox"; }
     #endif
   private:
-    bool checked_;
+    enum {
+      CHECKED = Label::NEXT_FLAG,
+      NEXT_FLAG = CHECKED << 1
+    };
+    SCREENUI_STATIC_ASSERT(NEXT_FLAG <= 0x100, flagsFit);
 };
 
 // A Component that allows the user to scroll through several choices and
@@ -265,6 +962,9 @@ class List : public Label {
     void setSelectedIndex(uint8_t selectedIndex);
     virtual bool acceptsFocus() { return true; }
     virtual bool handleInputEvent(int x, int y, bool selected, bool cancelled);
+    virtual uint8_t stateSize() { return 1; }
+    virtual void saveState(uint8_t *data) { data[0] = selectedIndex_; }
+    virtual void restoreState(const uint8_t *data);
     #ifdef SCREENUI_DEBUG
     virtual char *description() { return "List"; }
     #endif
@@ -280,15 +980,148 @@ class Spinner : public Label {
   public:
     Spinner(int value, int low, int high, int increment, bool rollover);
     int intValue();
+    // Sets the value, limited to the Spinner's range.
+    void setValue(int value);
     virtual bool acceptsFocus() { return true; }
     virtual bool handleInputEvent(int x, int y, bool selected, bool cancelled);
+    virtual uint8_t stateSize() { return 2; }
+    virtual void saveState(uint8_t *data);
+    virtual void restoreState(const uint8_t *data);
     #ifdef SCREENUI_DEBUG
     virtual char *description() { return "Spinner"; }
     #endif
   private:
+    enum {
+      ROLLOVER = Label::NEXT_FLAG,
+      NEXT_FLAG = ROLLOVER << 1
+    };
+    SCREENUI_STATIC_ASSERT(NEXT_FLAG <= 0x100, flagsFit);
     char buffer_[10];
     int value_, low_, high_, increment_;
-    bool rollover_;
+};
+
+// Base class for Components that display values as vertical bars built out
+// of partial block glyphs. Each column of the graph is one character wide and
+// height characters tall, giving 8 levels of resolution per character.
+// The graph remembers what it last drew in each column and only redraws
+// the characters whose fill level changed, so it can be updated at sensor
+// rates without repainting the whole graph.
+// Users should not generally create instances of this class.
+class LevelGraph : public Component {
+  public:
+    LevelGraph(uint8_t width, uint8_t height, int low, int high);
+    virtual ~LevelGraph();
+    virtual void paint(Screen *screen);
+    // Forces every character of the graph to be redrawn on the next paint.
+    // This is called by Containers when the graph has been moved or
+    // uncovered.
+    virtual void repaint();
+    #ifdef SCREENUI_DEBUG
+    virtual char *description() { return "LevelGraph"; }
+    #endif
+  protected:
+    enum {
+      FULL_REPAINT = Component::NEXT_FLAG,
+      NEXT_FLAG = FULL_REPAINT << 1
+    };
+    SCREENUI_STATIC_ASSERT(NEXT_FLAG <= 0x100, flagsFit);
+    // Converts value to a fill level between 0 and height * 8.
+    uint8_t levelOf(int value);
+    // Sets the fill level of the given column, marking the graph dirty if
+    // it changed.
+    void setLevel(uint8_t column, uint8_t level);
+
+    int low_, high_;
+    // The fill level of each column, and the fill level that was last drawn
+    // for each column.
+    uint8_t *levels_;
+    uint8_t *paintedLevels_;
+};
+
+// A LevelGraph that displays a fixed number of independent bars, such as
+// a set of sensor levels.
+class BarGraph : public LevelGraph {
+  public:
+    // Create a BarGraph with the given number of bars, each height characters
+    // tall, displaying values between low and high.
+    BarGraph(uint8_t bars, uint8_t height, int low, int high);
+    void setValue(uint8_t bar, int value);
+    #ifdef SCREENUI_DEBUG
+    virtual char *description() { return "BarGraph"; }
+    #endif
+};
+
+// A LevelGraph that displays the history of a single value. Each call to
+// push() scrolls the graph one column to the left and adds the new value
+// on the right.
+class Sparkline : public LevelGraph {
+  public:
+    Sparkline(uint8_t width, uint8_t height, int low, int high);
+    void push(int value);
+    #ifdef SCREENUI_DEBUG
+    virtual char *description() { return "Sparkline"; }
+    #endif
+};
+
+// A Component that displays the most recent lines of a log. Lines are kept in
+// a fixed size circular buffer that is allocated once when the LogView is
+// created, so append() never allocates and takes the same time no matter how
+// many lines have been logged.
+// While the LogView follows the end of the log, each append() moves the
+// visible lines up by one row. Since the display has no way to scroll, the
+// LogView remembers which lines are on screen and only redraws the characters
+// that differ from what is already there.
+// If the LogView is created as scrollable, it accepts focus and uses its
+// rightmost column as a focus indicator. Selecting it allows the user to
+// scroll back through the log. Selecting it again or cancelling returns to
+// the end of the log.
+class LogView : public Component {
+  public:
+    // Create a LogView with the given size on screen that remembers up to
+    // capacity lines. Lines longer than the LogView are truncated.
+    LogView(uint8_t width, uint8_t height, uint8_t capacity, bool scrollable = false);
+    virtual ~LogView();
+    // Adds a line to the end of the log, replacing the oldest line if the log
+    // is full.
+    void append(const char *text);
+    // Removes all lines from the log.
+    void clear();
+    uint8_t lineCount() { return count_; }
+    virtual bool acceptsFocus() { return flag(SCROLLABLE); }
+    virtual bool handleInputEvent(int x, int y, bool selected, bool cancelled);
+    virtual void paint(Screen *screen);
+    // Forces every character of the LogView to be redrawn on the next paint.
+    virtual void repaint();
+    #ifdef SCREENUI_DEBUG
+    virtual char *description() { return "LogView"; }
+    #endif
+  private:
+    enum {
+      CAPTURED = Component::NEXT_FLAG,
+      FULL_REPAINT = CAPTURED << 1,
+      SCROLLABLE = FULL_REPAINT << 1,
+      NEXT_FLAG = SCROLLABLE << 1
+    };
+    SCREENUI_STATIC_ASSERT(NEXT_FLAG <= 0x100, flagsFit);
+    // Returns the line that is the given number of lines before the end of
+    // the log.
+    char *line(uint8_t back);
+    uint8_t textWidth() { return flag(SCROLLABLE) ? width_ - 1 : width_; }
+
+    char *lines_;
+    uint8_t capacity_;
+    uint8_t count_;
+    // The slot the next line will be written to.
+    uint8_t head_;
+    // The number of lines between the bottom row and the end of the log. 0
+    // when following the end of the log.
+    uint8_t scroll_;
+    // What was on screen after the last paint, used to find the characters
+    // that need to be redrawn.
+    uint8_t paintedScroll_;
+    uint8_t paintedCount_;
+    uint8_t appendedSincePaint_;
+    char paintedIndicator_;
 };
 
 // allows text input. Each character can be clicked to scroll through the alphabet.
@@ -299,20 +1132,90 @@ class Input : public Label {
     virtual bool acceptsFocus() { return true; }
     virtual void paint(Screen *screen);
     virtual bool handleInputEvent(int x, int y, bool selected, bool cancelled);
+    // The text is saved and restored in place, at the width it has now.
+    virtual uint8_t stateSize() { return width_; }
+    virtual void saveState(uint8_t *data);
+    virtual void restoreState(const uint8_t *data);
     #ifdef SCREENUI_DEBUG
     virtual char *description() { return "Input"; }
     #endif
     void setCharSet(CharSet *charSet) { charSet_ = charSet; }
     CharSet *charSet() { return charSet_; }
   protected:
+    enum {
+      // Set while the character at position_ is being changed, rather than
+      // position_ being moved.
+      SELECTING = Label::NEXT_FLAG,
+      NEXT_FLAG = SELECTING << 1
+    };
+    SCREENUI_STATIC_ASSERT(NEXT_FLAG <= 0x100, flagsFit);
+    // Called after the text has been changed in place.
+    void textChanged();
+
     int8_t position_;
-    bool selecting_;
     CharSet *charSet_;
 };
 		
-// A Component that accepts input of a floating or fixed point decimal
-// number. 
-class DecimalInput : public Input {
+// An Input that edits a number one digit at a time. The number is stored as
+// a long and the text is generated from it, so editing a digit adds or
+// subtracts that digit's place value, carrying into the digits to its left
+// and staying within the limits. No floating point or printf code is used.
+// Users should not generally create instances of this class.
+// The most decimal digits an unsigned long can hold.
+#define DIGIT_INPUT_MAX_DIGITS ((sizeof(long) * 5 + 1) / 2)
+
+class DigitInput : public Input {
+  public:
+    DigitInput(long value, long low, long high);
+    long value() { return value_; }
+    // Sets the value, limited to the low and high limits.
+    void setValue(long value);
+    virtual bool handleInputEvent(int x, int y, bool selected, bool cancelled);
+    virtual uint8_t stateSize() { return 4; }
+    virtual void saveState(uint8_t *data);
+    virtual void restoreState(const uint8_t *data);
+    #ifdef SCREENUI_DEBUG
+    virtual char *description() { return "DigitInput"; }
+    #endif
+  protected:
+    // Returns how much the value changes when the digit at position is
+    // incremented, or 0 if the character at position can't be edited.
+    virtual long placeValue(uint8_t position) = 0;
+    // Returns true if the character at position can be edited.
+    virtual bool editable(uint8_t position) { return placeValue(position) != 0; }
+    // Changes the value by delta steps of the digit at position.
+    virtual void adjust(uint8_t position, int delta);
+    // Fills buffer_ with the text for value_.
+    virtual void format() = 0;
+    // Writes value into text as a zero padded number of the given width.
+    static void formatDigits(char *text, unsigned long value, uint8_t width);
+
+    long value_, low_, high_;
+    // A sign, the digits, a decimal point and the terminator.
+    char buffer_[DIGIT_INPUT_MAX_DIGITS + 3];
+};
+
+// A Component that accepts input of a fixed point decimal number. The value
+// is a scaled integer, so with 2 decimals a value of 1250 is shown as
+// 12.50. A sign is shown if low is negative, and the number of digits
+// before the decimal point is set by the larger of low and high. decimals is
+// limited to one less than DIGIT_INPUT_MAX_DIGITS.
+class DecimalInput : public DigitInput {
+  public:
+    DecimalInput(long value, uint8_t decimals, long low, long high);
+    uint8_t decimals() { return decimals_; }
+    #ifdef SCREENUI_DEBUG
+    virtual char *description() { return "DecimalInput"; }
+    #endif
+  protected:
+    virtual long placeValue(uint8_t position);
+    virtual bool editable(uint8_t position);
+    virtual void adjust(uint8_t position, int delta);
+    virtual void format();
+  private:
+    bool signed_;
+    uint8_t digits_;
+    uint8_t decimals_;
 };
 
 // A Component that accepts input of an integer value with a given base.
@@ -334,8 +1237,25 @@ class IntegerInput : public Input {
 };
 
 // Component that allows the user to enter a time with up to three fields
-// separated by semi-colons. e.g. 00, 00:00, 00:00:00
-class TimeInput : public Input {
+// separated by colons. e.g. 00, 00:00, 00:00:00
+// The value is a number of seconds. Editing a field carries into the field to
+// its left, so adding 10 to 55 seconds gives 1 minute 5 seconds. The first
+// field can go up to 99.
+class TimeInput : public DigitInput {
+  public:
+    TimeInput(long seconds, uint8_t fields = 3);
+    #ifdef SCREENUI_DEBUG
+    virtual char *description() { return "TimeInput"; }
+    #endif
+  protected:
+    virtual long placeValue(uint8_t position);
+    virtual void format();
+  private:
+    // The number of seconds in one unit of the given field, counting from
+    // the right.
+    long fieldUnit(uint8_t field);
+
+    uint8_t fields_;
 };
 
 // A Container that allows the user to scroll through any number of rows of
@@ -357,6 +1277,8 @@ class ScrollContainer : public Container {
     #ifdef SCREENUI_DEBUG
     virtual char *description() { return "ScrollContainer"; }
     #endif
+  protected:
+    virtual bool scrolls() { return true; }
   private:
     bool scrollNeeded();
   
@@ -365,9 +1287,133 @@ class ScrollContainer : public Container {
     char *clearLine;
 };
 
-// A specialization of ScrollContainer that contains only Buttons and provides
-// a simple API for managing the set of Buttons like a menu.
-class Menu : public ScrollContainer {
+// One entry in a Menu's table. The entries of each level of the menu are
+// stored one after another and the level ends with an entry whose label is
+// NULL. The root level starts at index 0.
+// label is a string stored in PROGMEM. child is the index of the first entry
+// of the entry's submenu, or 0 if it has none. action is reported by
+// Menu::action() when an entry without a submenu is selected.
+struct MenuEntry {
+  const char *label;
+  uint16_t child;
+  uint8_t action;
+};
+
+#define MENU_MAX_DEPTH 4
+
+// A Component that lets the user navigate a tree of menus described by a
+// table of MenuEntry stored in PROGMEM, for instance:
+//
+//   const char settingsLabel[] PROGMEM = "Settings";
+//   const char aboutLabel[] PROGMEM = "About";
+//   const char backlightLabel[] PROGMEM = "Backlight";
+//   const MenuEntry menuEntries[] PROGMEM = {
+//     { settingsLabel, 3, 0 },   // 0: the root level
+//     { aboutLabel, 0, 1 },
+//     { NULL, 0, 0 },
+//     { backlightLabel, 0, 2 },  // 3: the Settings submenu
+//     { NULL, 0, 0 }
+//   };
+//
+// Nothing is built for the entries. The Menu only remembers which level is
+// open, the selected entry and the entry in the top row, plus the same for
+// each parent level up to MENU_MAX_DEPTH deep, and reads labels from the
+// table as it draws them. A menu of any size uses the same few bytes of RAM.
+// Selecting the Menu captures input. While captured, scrolling moves through
+// the entries of the open level, selecting enters a submenu or reports an
+// action, and cancelling returns to the parent level or releases the Menu.
+class Menu : public Component {
+  public:
+    Menu(const MenuEntry *entries, uint8_t width, uint8_t height);
+    // Returns the action of the entry the user selected during this update,
+    // or 0 if none was selected.
+    uint8_t action() { return action_; }
+    virtual bool acceptsFocus() { return true; }
+    virtual void update(Screen *screen);
+    virtual bool handleInputEvent(int x, int y, bool selected, bool cancelled);
+    virtual void paint(Screen *screen);
+    // Forces every row of the Menu to be redrawn on the next paint.
+    virtual void repaint();
+    #ifdef SCREENUI_DEBUG
+    virtual char *description() { return "Menu"; }
+    #endif
+  private:
+    enum {
+      CAPTURED = Component::NEXT_FLAG,
+      FULL_REPAINT = CAPTURED << 1,
+      NEXT_FLAG = FULL_REPAINT << 1
+    };
+    SCREENUI_STATIC_ASSERT(NEXT_FLAG <= 0x100, flagsFit);
+    // Opens the level that starts at the given entry.
+    void open(uint16_t level, uint8_t selected, uint8_t top);
+    void paintRow(Screen *screen, uint8_t row);
+    char marker(Screen *screen);
+
+    const MenuEntry *entries_;
+    uint16_t level_;
+    uint8_t levelLength_;
+    uint8_t selected_;
+    uint8_t top_;
+    uint8_t depth_;
+    struct {
+      uint16_t level;
+      uint8_t selected;
+      uint8_t top;
+    } parents_[MENU_MAX_DEPTH];
+    uint8_t action_;
+    uint8_t paintedSelected_;
+    uint8_t paintedTop_;
+    char paintedMarker_;
+};
+
+// Storage for a StateSnapshot, such as EEPROM, a page of flash or a file.
+// The user should create a subclass that implements read() and write() for
+// their hardware.
+class StateStorage {
+  public:
+    virtual uint8_t read(uint16_t address) = 0;
+    virtual void write(uint16_t address, uint8_t value) = 0;
+    // Called after a save has written all of its bytes. Storage that has to
+    // be written a page at a time, like flash, can write the page here.
+    virtual void commit() {}
+};
+
+// Saves and restores the values of a set of Components, such as the
+// Checkboxes, Lists, Spinners and Inputs on a settings Screen.
+// Each Component is added with an id that identifies it in the snapshot, so
+// Components can be added, removed or reordered between versions of a program
+// without disturbing the values of the others.
+// The snapshot is stored as a header followed by an id, a length and the
+// value of each Component. save() compares each byte with what is already in
+// storage and only writes the bytes that changed, so saving a screen where
+// one value changed only writes that value.
+class StateSnapshot {
+  public:
+    // Create a StateSnapshot stored in storage starting at address. version
+    // is the user's version of the settings. A snapshot saved with a
+    // different version will not be restored.
+    StateSnapshot(StateStorage *storage, uint16_t address = 0, uint8_t version = 0);
+    virtual ~StateSnapshot();
+    // Returns false if there was no memory to add the Component.
+    bool add(uint8_t id, Component *component);
+    // Restores the value of every added Component found in storage. Returns
+    // false if storage does not hold a snapshot of this version, or there
+    // was no memory for a value.
+    bool restore();
+    // Saves the value of every added Component. Returns the number of bytes
+    // that had to be written, which is 0 if there was no memory for a value.
+    uint16_t save();
+  private:
+    // Writes value at address if it is not already there.
+    bool update(uint16_t address, uint8_t value);
+    uint8_t maxStateSize();
+
+    StateStorage *storage_;
+    uint16_t address_;
+    uint8_t version_;
+    Component **components_;
+    uint8_t *ids_;
+    uint8_t componentCount_;
 };
 
-#endif
\ No newline at end of file
+#endif
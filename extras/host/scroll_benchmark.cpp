@@ -0,0 +1,133 @@
+// Scrolls a ScrollContainer of Buttons, one per row, from the first row to
+// the last and back, and reports how long each update took and how many
+// characters were drawn. It checks that the focused Button is on screen at
+// the bottom and that the first rows are back where they started at the top.
+//
+// The default 8-bit build handles up to 255 rows:
+//   g++ -O2 -I../.. -DSCREENUI_DEFAULT_HARDWARE -o scroll_benchmark scroll_benchmark.cpp ../../ScreenUi.cpp
+//   ./scroll_benchmark 129
+// Thousands of rows need the wide build:
+//   g++ -O2 -I../.. -DSCREENUI_DEFAULT_HARDWARE -DSCREENUI_WIDE_COORDINATES -o scroll_benchmark scroll_benchmark.cpp ../../ScreenUi.cpp
+//   ./scroll_benchmark 5000
+// It exits with 0 if every check passed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ScreenUi.h>
+
+#define WIDTH 20
+#define HEIGHT 4
+
+// A Screen that keeps what is drawn in memory and takes its input from
+// move().
+class MemoryScreen : public Screen {
+  public:
+    MemoryScreen() : Screen(WIDTH, HEIGHT) {
+      memset(cells_, ' ', sizeof(cells_));
+      y_ = 0;
+      drawn_ = 0;
+    }
+    void move(int y) { y_ = y; }
+    long drawn() { return drawn_; }
+    // Returns row y as a string.
+    const char *row(uint8_t y) {
+      memcpy(row_, cells_[y], WIDTH);
+      row_[WIDTH] = 0;
+      return row_;
+    }
+
+    virtual void getInputDeltas(int *x, int *y, bool *selected, bool *cancelled) {
+      *x = 0;
+      *y = y_;
+      *selected = *cancelled = false;
+      y_ = 0;
+    }
+    virtual void clear() {
+      memset(cells_, ' ', sizeof(cells_));
+    }
+    virtual void draw(uint8_t x, uint8_t y, const char *text) {
+      for (; *text; text++, x++) {
+        draw(x, y, (uint8_t) *text);
+      }
+    }
+    virtual void draw(uint8_t x, uint8_t y, uint8_t customChar) {
+      if (x < WIDTH && y < HEIGHT) {
+        cells_[y][x] = customChar;
+      }
+      drawn_++;
+    }
+  private:
+    char cells_[HEIGHT][WIDTH];
+    char row_[WIDTH + 1];
+    int y_;
+    long drawn_;
+};
+
+static double seconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Checks that row y of the screen starts with text.
+static bool check(MemoryScreen *screen, uint8_t y, const char *text) {
+  if (strncmp(screen->row(y), text, strlen(text))) {
+    printf("row %d is \"%s\", expected \"%s\"\n", y, screen->row(y), text);
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  long rows = argc > 1 ? atol(argv[1]) : 129;
+  if (rows < HEIGHT || rows > SCREEN_COUNT_MAX) {
+    printf("rows must be from %d to %ld in this build\n", HEIGHT, (long) SCREEN_COUNT_MAX);
+    return 1;
+  }
+  MemoryScreen screen;
+  ScrollContainer container(&screen, WIDTH, HEIGHT);
+  screen.add(&container, 0, 0);
+  char (*texts)[8] = (char (*)[8]) malloc(rows * sizeof(*texts));
+  for (long i = 0; i < rows; i++) {
+    snprintf(texts[i], sizeof(texts[i]), "%ld", i);
+    // Rows past the end of the coordinate type wrap, which offsetChildren()
+    // undoes as they scroll in to view.
+    container.add(new Button(texts[i]), 0, (screen_coord_t) i);
+  }
+  screen.update();
+
+  bool passed = true;
+  char expected[16];
+  double start = seconds();
+  long drawn = screen.drawn();
+  for (long i = 1; i < rows; i++) {
+    screen.move(1);
+    screen.update();
+  }
+  double down = seconds() - start;
+  long drawnDown = screen.drawn() - drawn;
+  snprintf(expected, sizeof(expected), "<%ld>", rows - 1);
+  passed &= check(&screen, HEIGHT - 1, expected);
+
+  start = seconds();
+  drawn = screen.drawn();
+  for (long i = 1; i < rows; i++) {
+    screen.move(-1);
+    screen.update();
+  }
+  double up = seconds() - start;
+  long drawnUp = screen.drawn() - drawn;
+  passed &= check(&screen, 0, "<0>");
+  passed &= check(&screen, 1, "[1]");
+  passed &= check(&screen, 2, "[2]");
+
+  printf("%ld rows, %d-bit coordinates\n", rows, (int) sizeof(screen_coord_t) * 8);
+  printf("down: %.2f us per update, %.1f characters drawn per update\n",
+      down * 1e6 / (rows - 1), (double) drawnDown / (rows - 1));
+  printf("up:   %.2f us per update, %.1f characters drawn per update\n",
+      up * 1e6 / (rows - 1), (double) drawnUp / (rows - 1));
+  printf("%s\n", passed ? "passed" : "FAILED");
+  return passed ? 0 : 1;
+}
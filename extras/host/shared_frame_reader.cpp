@@ -0,0 +1,154 @@
+// Checks SharedMemoryScreen against a reader in another process on a Linux
+// host. The parent shows a Screen in a shared memory segment and changes it
+// a few times, and a forked child reads every frame with SharedFrameReader
+// and checks that it only ever sees complete ones.
+//
+// Build and run from this directory with:
+//   g++ -I../.. -DSCREENUI_DEFAULT_HARDWARE -o shared_frame_reader shared_frame_reader.cpp ../../ScreenUi.cpp -lrt
+//   ./shared_frame_reader
+// It prints the last frame the reader saw and exits with 0 if every check
+// passed.
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <ScreenUi.h>
+
+#define NAME "/screenui-reader-test"
+#define WIDTH 20
+#define HEIGHT 4
+#define FRAMES 2000
+
+class TestScreen : public SharedMemoryScreen {
+  public:
+    TestScreen() : SharedMemoryScreen(WIDTH, HEIGHT, NAME) {}
+    virtual void getInputDeltas(int *x, int *y, bool *selected, bool *cancelled) {
+      *x = *y = 0;
+      *selected = *cancelled = false;
+    }
+};
+
+// Each frame shows the same number on every row, so a frame that was read
+// while it was being changed has rows that differ.
+static bool consistent(const char *cells) {
+  for (int y = 1; y < HEIGHT; y++) {
+    if (memcmp(cells, cells + y * WIDTH, WIDTH)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static int reader(pid_t writer, int *status, int ready) {
+  // The segment may not exist until the writer has started.
+  SharedFrameReader *frameReader = NULL;
+  for (int tries = 0; tries < 1000; tries++) {
+    frameReader = new SharedFrameReader(NAME);
+    if (frameReader->valid()) {
+      break;
+    }
+    delete frameReader;
+    frameReader = NULL;
+    usleep(1000);
+  }
+  if (!frameReader) {
+    printf("reader: no segment\n");
+    close(ready);
+    waitpid(writer, status, 0);
+    return 1;
+  }
+  // Let the writer start changing the frame.
+  char byte = 0;
+  write(ready, &byte, 1);
+  close(ready);
+  SharedFrame frame;
+  char cells[WIDTH * HEIGHT];
+  char last[WIDTH * HEIGHT];
+  int frames = 0, failures = 0;
+  uint32_t sequence = 0;
+  memset(last, ' ', sizeof(last));
+  // Read until the writer has finished and the last frame has been seen.
+  bool finished = false;
+  while (true) {
+    finished = finished || waitpid(writer, status, WNOHANG) == writer;
+    if (frameReader->sequence() != sequence) {
+      if (frameReader->read(&frame, cells)) {
+        sequence = frame.sequence;
+        frames++;
+        if (!consistent(cells)) {
+          failures++;
+        }
+        memcpy(last, cells, sizeof(last));
+      }
+    }
+    else if (finished) {
+      break;
+    }
+  }
+  for (int y = 0; y < HEIGHT; y++) {
+    printf("|%.*s|\n", WIDTH, last + y * WIDTH);
+  }
+  // The checkmark glyph has to be published for a Checkbox to be drawn.
+  if (frame.glyphs[7][4] != 20) {
+    printf("reader: checkmark glyph missing\n");
+    failures++;
+  }
+  if (memcmp(last, "#1999", 5)) {
+    printf("reader: last frame not seen\n");
+    failures++;
+  }
+  printf("reader: %d frames read, %d inconsistent\n", frames, failures);
+  delete frameReader;
+  return failures ? 1 : 0;
+}
+
+int main() {
+  // The writer runs in the child so the reader can tell when it has exited.
+  // It waits for the reader to attach before it changes the frame.
+  int ready[2];
+  if (pipe(ready)) {
+    return 1;
+  }
+  pid_t writer = fork();
+  if (writer == 0) {
+    close(ready[1]);
+    TestScreen *screen = new TestScreen();
+    if (!screen->valid()) {
+      _exit(1);
+    }
+    char byte;
+    if (read(ready[0], &byte, 1) != 1) {
+      _exit(1);
+    }
+    Label *labels[HEIGHT];
+    char text[HEIGHT][8];
+    for (int y = 0; y < HEIGHT; y++) {
+      labels[y] = new Label("");
+      screen->add(labels[y], 0, y);
+    }
+    for (int i = 0; i < FRAMES; i++) {
+      for (int y = 0; y < HEIGHT; y++) {
+        snprintf(text[y], sizeof(text[y]), "#%d", i);
+        labels[y]->setText(text[y]);
+      }
+      screen->update();
+      // Slow enough for the reader to see most frames, but it still reads
+      // plenty of them while they are being changed.
+      usleep(50);
+    }
+    // Removes the segment.
+    delete screen;
+    _exit(0);
+  }
+  // The reader keeps its mapping after the writer removes the segment, so
+  // it can still read the last frame.
+  close(ready[0]);
+  int status = 0;
+  int result = reader(writer, &status, ready[1]);
+  if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+    printf("writer failed\n");
+    result = 1;
+  }
+  return result;
+}